@@ -0,0 +1,192 @@
+#include "GatherWriter.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <climits>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+GatherWriter::GatherWriter(uint64_t position) : position(position)
+{
+}
+
+void GatherWriter::Append(const void* data, size_t size)
+{
+    if (size == 0)
+    {
+        return;
+    }
+
+    if (!lastOwned)
+    {
+        // Owned segments hold offsets, since the buffer may move as it grows
+        segments.push_back({ nullptr, owned.size(), 0 });
+        lastOwned = true;
+    }
+
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+
+    owned.insert(owned.end(), bytes, bytes + size);
+    segments.back().Size += size;
+    position += size;
+}
+
+void GatherWriter::Reference(const void* data, size_t size)
+{
+    if (size == 0)
+    {
+        return;
+    }
+
+    segments.push_back({ static_cast<const uint8_t*>(data), 0, size });
+    lastOwned = false;
+    position += size;
+}
+
+void GatherWriter::Align(size_t alignment, uint8_t paddingByte)
+{
+    size_t count = (alignment - position % alignment) % alignment;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        Append(&paddingByte, 1);
+    }
+}
+
+void GatherWriter::Advance(uint64_t size)
+{
+    position += size;
+}
+
+uint64_t GatherWriter::Position() const
+{
+    return position;
+}
+
+const uint8_t* GatherWriter::Resolve(const Segment& segment) const
+{
+    return segment.Data ? segment.Data : owned.data() + segment.Offset;
+}
+
+void GatherWriter::Clear()
+{
+    owned.clear();
+    segments.clear();
+    lastOwned = false;
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+#ifdef IOV_MAX
+static constexpr size_t MaxIovecs = IOV_MAX;
+#else
+static constexpr size_t MaxIovecs = 1024;
+#endif
+
+// Gathers segments into iovecs and writes them, picking up after short writes. With offset
+// negative, writes at the file position.
+static bool WriteSegments(int fd, vector<iovec>& iov, int64_t offset)
+{
+    for (size_t first = 0; first < iov.size(); )
+    {
+        int count = static_cast<int>(min(iov.size() - first, MaxIovecs));
+#ifdef __linux__
+        ssize_t written = offset < 0 ? writev(fd, &iov[first], count) : pwritev(fd, &iov[first], count, offset);
+#else
+        ssize_t written = writev(fd, &iov[first], count);
+#endif
+
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return false;
+        }
+
+        if (offset >= 0)
+        {
+            offset += written;
+        }
+
+        for (size_t remaining = static_cast<size_t>(written); remaining > 0; )
+        {
+            size_t taken = min(remaining, iov[first].iov_len);
+
+            iov[first].iov_base = static_cast<uint8_t*>(iov[first].iov_base) + taken;
+            iov[first].iov_len -= taken;
+            remaining -= taken;
+
+            if (iov[first].iov_len == 0)
+            {
+                ++first;
+            }
+        }
+
+        while (first < iov.size() && iov[first].iov_len == 0)
+        {
+            ++first;
+        }
+    }
+
+    return true;
+}
+
+bool GatherWriter::Flush(int fd)
+{
+    vector<iovec> iov;
+
+    for (const auto& segment : segments)
+    {
+        iov.push_back({ const_cast<uint8_t*>(Resolve(segment)), segment.Size });
+    }
+
+    bool written = WriteSegments(fd, iov, -1);
+
+    Clear();
+
+    return written;
+}
+#endif
+
+#ifdef __linux__
+bool GatherWriter::FlushAt(int fd, uint64_t offset)
+{
+    vector<iovec> iov;
+
+    for (const auto& segment : segments)
+    {
+        iov.push_back({ const_cast<uint8_t*>(Resolve(segment)), segment.Size });
+    }
+
+    bool written = WriteSegments(fd, iov, static_cast<int64_t>(offset));
+
+    Clear();
+
+    return written;
+}
+#endif
+
+bool GatherWriter::Flush(ByteSink& sink)
+{
+    bool written = true;
+
+    for (const auto& segment : segments)
+    {
+        if (written)
+        {
+            written = sink.Write(Resolve(segment), segment.Size);
+        }
+    }
+
+    Clear();
+
+    return written;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "Sinks.h"
+
+// Collects output as a list of segments and keeps track of the position itself, so padding never
+// has to ask the stream where it is. Appended bytes are copied into one growing buffer, and
+// consecutive appends share a segment; referenced bytes are left where they are. Flushing hands
+// every segment to the output in as few gather writes as the platform allows.
+class GatherWriter
+{
+public:
+    explicit GatherWriter(uint64_t position = 0);
+
+    void Append(const void* data, size_t size);
+    // The bytes must stay alive and unchanged until the next flush
+    void Reference(const void* data, size_t size);
+    void Align(size_t alignment, uint8_t paddingByte);
+    // Accounts for bytes that went to the output some other way
+    void Advance(uint64_t size);
+
+    uint64_t Position() const;
+
+#if defined(__unix__) || defined(__APPLE__)
+    bool Flush(int fd);
+#endif
+#ifdef __linux__
+    bool FlushAt(int fd, uint64_t offset);
+#endif
+    bool Flush(ByteSink& sink);
+
+private:
+    struct Segment
+    {
+        const uint8_t* Data;
+        size_t Offset;
+        size_t Size;
+    };
+
+    std::vector<uint8_t> owned;
+    std::vector<Segment> segments;
+    uint64_t position;
+    bool lastOwned = false;
+
+    const uint8_t* Resolve(const Segment& segment) const;
+    void Clear();
+};
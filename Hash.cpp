@@ -0,0 +1,155 @@
+#include "Hash.h"
+
+#include <cstring>
+
+static constexpr uint64_t Prime1 = 0x9E3779B185EBCA87ULL;
+static constexpr uint64_t Prime2 = 0xC2B2AE3D27D4EB4FULL;
+static constexpr uint64_t Prime3 = 0x165667B19E3779F9ULL;
+static constexpr uint64_t Prime4 = 0x85EBCA77C2B2AE63ULL;
+static constexpr uint64_t Prime5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t RotateLeft(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// The archive format is little-endian, and so is every platform knarc builds for
+static inline uint64_t Read64(const uint8_t* p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t Read32(const uint8_t* p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t Round(uint64_t accumulator, uint64_t input)
+{
+    accumulator += input * Prime2;
+    accumulator = RotateLeft(accumulator, 31);
+    return accumulator * Prime1;
+}
+
+static inline uint64_t Merge(uint64_t hash, uint64_t accumulator)
+{
+    hash ^= Round(0, accumulator);
+    return hash * Prime1 + Prime4;
+}
+
+Xxh64::Xxh64(uint64_t seed) : seed(seed)
+{
+    accumulators[0] = seed + Prime1 + Prime2;
+    accumulators[1] = seed + Prime2;
+    accumulators[2] = seed;
+    accumulators[3] = seed - Prime1;
+}
+
+void Xxh64::Update(const void* data, size_t size)
+{
+    // An empty file maps to no data at all, and memcpy must not be handed a null pointer
+    if (size == 0)
+    {
+        return;
+    }
+
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    const uint8_t* end = p + size;
+
+    totalSize += size;
+
+    if (buffered + size < sizeof(buffer))
+    {
+        memcpy(buffer + buffered, p, size);
+        buffered += size;
+        return;
+    }
+
+    if (buffered > 0)
+    {
+        size_t fill = sizeof(buffer) - buffered;
+        memcpy(buffer + buffered, p, fill);
+        p += fill;
+
+        for (int i = 0; i < 4; ++i)
+        {
+            accumulators[i] = Round(accumulators[i], Read64(buffer + i * 8));
+        }
+
+        buffered = 0;
+    }
+
+    for (; end - p >= 32; p += 32)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            accumulators[i] = Round(accumulators[i], Read64(p + i * 8));
+        }
+    }
+
+    buffered = end - p;
+    memcpy(buffer, p, buffered);
+}
+
+uint64_t Xxh64::Digest() const
+{
+    uint64_t hash;
+
+    if (totalSize >= 32)
+    {
+        hash = RotateLeft(accumulators[0], 1) + RotateLeft(accumulators[1], 7) + RotateLeft(accumulators[2], 12) + RotateLeft(accumulators[3], 18);
+
+        for (int i = 0; i < 4; ++i)
+        {
+            hash = Merge(hash, accumulators[i]);
+        }
+    }
+    else
+    {
+        hash = seed + Prime5;
+    }
+
+    hash += totalSize;
+
+    const uint8_t* p = buffer;
+    const uint8_t* end = buffer + buffered;
+
+    for (; end - p >= 8; p += 8)
+    {
+        hash ^= Round(0, Read64(p));
+        hash = RotateLeft(hash, 27) * Prime1 + Prime4;
+    }
+
+    if (end - p >= 4)
+    {
+        hash ^= static_cast<uint64_t>(Read32(p)) * Prime1;
+        hash = RotateLeft(hash, 23) * Prime2 + Prime3;
+        p += 4;
+    }
+
+    for (; p < end; ++p)
+    {
+        hash ^= *p * Prime5;
+        hash = RotateLeft(hash, 11) * Prime1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= Prime2;
+    hash ^= hash >> 29;
+    hash *= Prime3;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+uint64_t Xxh64::Hash(const void* data, size_t size, uint64_t seed)
+{
+    Xxh64 state(seed);
+    state.Update(data, size);
+
+    return state.Digest();
+}
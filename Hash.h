@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Streaming XXH64. Fast and non-cryptographic: good for spotting changed or duplicate members,
+// not for anything adversarial.
+class Xxh64
+{
+public:
+    explicit Xxh64(uint64_t seed = 0);
+
+    void Update(const void* data, size_t size);
+    uint64_t Digest() const;
+
+    static uint64_t Hash(const void* data, size_t size, uint64_t seed = 0);
+
+private:
+    uint64_t accumulators[4];
+    uint64_t seed;
+    uint64_t totalSize = 0;
+    uint8_t buffer[32];
+    size_t buffered = 0;
+};
@@ -0,0 +1,110 @@
+#include "MappedFile.h"
+
+#include <fstream>
+#include <ios>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define KNARC_HAVE_MMAP
+#endif
+
+using namespace std;
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+bool MappedFile::Open(const fs::path& path)
+{
+    Close();
+
+#ifdef KNARC_HAVE_MMAP
+    int fd = open(path.c_str(), O_RDONLY);
+
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        return false;
+    }
+
+    size = static_cast<size_t>(st.st_size);
+
+    if (size > 0)
+    {
+        void* address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (address == MAP_FAILED)
+        {
+            close(fd);
+            size = 0;
+            return false;
+        }
+
+        data = static_cast<const uint8_t*>(address);
+        mapped = true;
+    }
+
+    // The mapping stays valid after the descriptor is closed
+    close(fd);
+
+    return true;
+#else
+    ifstream ifs(path, ios::binary | ios::ate);
+
+    if (!ifs.good())
+    {
+        return false;
+    }
+
+    contents.resize(static_cast<size_t>(ifs.tellg()));
+    ifs.seekg(0);
+
+    if (!ifs.read(reinterpret_cast<char*>(contents.data()), contents.size()))
+    {
+        contents.clear();
+        return false;
+    }
+
+    data = contents.data();
+    size = contents.size();
+
+    return true;
+#endif
+}
+
+void MappedFile::Close()
+{
+#ifdef KNARC_HAVE_MMAP
+    if (mapped)
+    {
+        munmap(const_cast<uint8_t*>(data), size);
+    }
+#endif
+
+    data = nullptr;
+    size = 0;
+    mapped = false;
+    contents.clear();
+}
+
+const uint8_t* MappedFile::Data() const
+{
+    return data;
+}
+
+size_t MappedFile::Size() const
+{
+    return size;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if (__cplusplus < 201703L)
+#include <experimental/filesystem>
+namespace fs = std::experimental::filesystem;
+#else
+#include <filesystem>
+namespace fs = std::filesystem;
+#endif
+
+struct ByteSpan
+{
+    const uint8_t* Data;
+    size_t Size;
+};
+
+// Read-only view of a whole file. Uses mmap where available and falls back to reading the file
+// into memory elsewhere.
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool Open(const fs::path& path);
+    void Close();
+
+    const uint8_t* Data() const;
+    size_t Size() const;
+
+private:
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+    bool mapped = false;
+    std::vector<uint8_t> contents;
+};
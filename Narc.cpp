@@ -1,22 +1,48 @@
 #include "Narc.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
-#include <iomanip>
+#include <functional>
 #include <ios>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <regex>
+#include <set>
 #include <sstream>
-#include <stack>
 #include <string>
+#include <system_error>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
+#include "GatherWriter.h"
+#include "Hash.h"
+#include "MappedFile.h"
+#include "NarcReader.h"
+#include "Parallel.h"
+#include "PatternMatcher.h"
+#include "Profiler.h"
+#include "Sinks.h"
 #include "fnmatch.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/stat.h>
+#endif
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+#endif
+
 #if (__cplusplus < 201703L)
 #include <experimental/filesystem>
 namespace fs = std::experimental::filesystem;
@@ -27,24 +53,22 @@ namespace fs = std::filesystem;
 
 using namespace std;
 
-extern bool debug;
-extern bool pack_no_fnt;
-extern bool output_header;
+// Jobs running side by side share stderr, so each debug line is formatted first and written whole
+static mutex debugMutex;
 
-void Narc::AlignDword(ofstream& ofs, uint8_t paddingChar)
+template <typename... Args>
+static void DebugLine(const Args&... args)
 {
-    if ((ofs.tellp() % 4) != 0)
-    {
-        for (int i = 4 - (ofs.tellp() % 4); i-- > 0; )
-        {
-            ofs.write(reinterpret_cast<char*>(&paddingChar), sizeof(uint8_t));
-        }
-    }
+    ostringstream line;
+    (line << ... << args);
+
+    lock_guard<mutex> lock(debugMutex);
+    cerr << "DEBUG: " << line.str() << endl;
 }
 
-bool Narc::Cleanup(ifstream& ifs, const NarcError& e)
+bool Narc::Cleanup(MappedFile& file, const NarcError& e)
 {
-    ifs.close();
+    file.Close();
 
     error = e;
 
@@ -60,10 +84,51 @@ bool Narc::Cleanup(ofstream& ofs, const NarcError& e)
     return false;
 }
 
+struct PathHash
+{
+    size_t operator()(const fs::path& p) const
+    {
+        return fs::hash_value(p);
+    }
+};
+
+// Sorts entries by their lowercased filename. The keys are built once up front rather than on
+// every comparison; the comparison itself is unchanged, so the resulting order is too.
+static void SortByCollationKey(vector<fs::directory_entry>& entries)
+{
+    vector<pair<string, fs::directory_entry>> keyed;
+    keyed.reserve(entries.size());
+
+    for (auto& entry : entries)
+    {
+        string key = entry.path().filename().string();
+
+        for (size_t i = 0; i < key.size(); ++i)
+        {
+            key[i] = tolower(key[i]);
+        }
+
+        keyed.emplace_back(move(key), move(entry));
+    }
+
+    sort(keyed.begin(), keyed.end(), [](const pair<string, fs::directory_entry>& a, const pair<string, fs::directory_entry>& b)
+        {
+            return a.first < b.first;
+        });
+
+    for (size_t i = 0; i < keyed.size(); ++i)
+    {
+        entries[i] = move(keyed[i].second);
+    }
+}
+
 std::vector<fs::directory_entry> Narc::KnarcOrderDirectoryIterator(const fs::path& path, bool recursive) const
 {
     std::vector<fs::directory_entry> ordered_files;
     std::vector<fs::directory_entry> unordered_files;
+    std::unordered_set<fs::path, PathHash> listed_files;
+
+    Count(options.Profile, Counter::StatCalls);
 
     // open the order file
     if (fs::exists(path / ".knarcorder"))
@@ -71,22 +136,24 @@ std::vector<fs::directory_entry> Narc::KnarcOrderDirectoryIterator(const fs::pat
         std::ifstream order_file(path / ".knarcorder");
         if (order_file)
         {
-            if (debug)
+            if (options.Debug)
             {
-                cerr << "DEBUG: knarcorder file exists" << endl;
+                DebugLine("knarcorder file exists");
             }
             // read the filenames in the order file and add the corresponding directory entries to the ordered files vector
             std::string filename;
             while (std::getline(order_file, filename))
             {
                 fs::path file_path = path / filename;
+                Count(options.Profile, Counter::StatCalls);
                 if (fs::exists(file_path))
                 {
-                    if (debug)
+                    if (options.Debug)
                     {
-                        cerr << "DEBUG: knarcorder file: " << file_path << endl;
+                        DebugLine("knarcorder file: ", file_path);
                     }
                     ordered_files.push_back(fs::directory_entry(file_path));
+                    listed_files.insert(file_path);
                 }
             }
         }
@@ -112,31 +179,13 @@ std::vector<fs::directory_entry> Narc::KnarcOrderDirectoryIterator(const fs::pat
     {
         if (entry.is_regular_file() && entry.path().filename() != ".knarcorder")
         {
-            if (std::find(ordered_files.begin(), ordered_files.end(), entry) == ordered_files.end())
+            if (!listed_files.count(entry.path()))
             {
                 unordered_files.push_back(entry);
             }
         }
     }
-    std::sort(unordered_files.begin(), unordered_files.end(),
-              [](const fs::directory_entry& a, const fs::directory_entry& b)
-              {
-                  // I fucking hate C++
-                  string aStr = a.path().filename().string();
-                  string bStr = b.path().filename().string();
-
-                  for (size_t i = 0; i < aStr.size(); ++i)
-                  {
-                      aStr[i] = tolower(aStr[i]);
-                  }
-
-                  for (size_t i = 0; i < bStr.size(); ++i)
-                  {
-                      bStr[i] = tolower(bStr[i]);
-                  }
-
-                  return aStr < bStr;
-              });
+    SortByCollationKey(unordered_files);
     ordered_files.insert(ordered_files.end(), unordered_files.begin(), unordered_files.end());
 
     return ordered_files;
@@ -151,24 +200,7 @@ vector<fs::directory_entry> Narc::OrderedDirectoryIterator(const fs::path& path,
         v.push_back(de);
     }
 
-    sort(v.begin(), v.end(), [](const fs::directory_entry& a, const fs::directory_entry& b)
-        {
-            // I fucking hate C++
-            string aStr = a.path().filename().string();
-            string bStr = b.path().filename().string();
-
-            for (size_t i = 0; i < aStr.size(); ++i)
-            {
-                aStr[i] = tolower(aStr[i]);
-            }
-
-            for (size_t i = 0; i < bStr.size(); ++i)
-            {
-                bStr[i] = tolower(bStr[i]);
-            }
-
-            return aStr < bStr;
-        });
+    SortByCollationKey(v);
 
     if (recursive)
     {
@@ -188,533 +220,2281 @@ vector<fs::directory_entry> Narc::OrderedDirectoryIterator(const fs::path& path,
     return v;
 }
 
+Narc::Narc(const NarcOptions& options) : options(options)
+{
+}
+
 NarcError Narc::GetError() const
 {
     return error;
 }
 
-class WildcardVector : public vector<string> {
-public:
-    WildcardVector(fs::path fp) {
-        fstream infile;
-        if (!fs::exists(fp)) return;
-        infile.open(fp, ios_base::in);
-        string line;
-        while (getline(infile, line)) {
-            if (!line.empty())
-            {
-                // strip CR
-                size_t i;
-                for (i = line.size() - 1; line[i] == '\r'; i--)
-                    ;
-                if (i < line.size() - 1)
-                    line.erase(i + 1);
-                push_back(line);
-            }
-        }
-    }
-    bool matches(string fp) {
-        for (string& pattern : *this) {
-            if (fnmatch(pattern.c_str(), fp.c_str(), FNM_PERIOD) == 0)
-                return true;
-        }
-        return false;
-    }
-};
+static constexpr size_t CopyBufferSize = 0x10000;
 
-bool Narc::Pack(const fs::path& fileName, const fs::path& directory)
+#ifdef __linux__
+// Writes size bytes of source to outFd, at *offset if given (advancing it) or at the file position
+// otherwise. Tries copy_file_range first, then sendfile, and finally falls back to a plain
+// read/write loop for filesystems that support neither. Given a hash, it always takes the loop,
+// so the bytes can be hashed on their way through.
+static NarcError CopyMember(int outFd, const fs::path& source, uint32_t size, off_t* offset, Xxh64* hash)
 {
-    ofstream ofs(fileName, ios::binary);
-
-    if (!ofs.good()) { return Cleanup(ofs, NarcError::InvalidOutputFile); }
+    int inFd = open(source.c_str(), O_RDONLY);
 
-    ofstream ofhs;
-    string stem;
-    string stem_upper;
-    // Pikalax 29 May 2021
-    // Output an includable header that enumerates the NARC contents
-    if (output_header)
+    if (inFd < 0)
     {
-        fs::path naixfname = fileName;
-        naixfname.replace_extension(".naix");
-
-        ofhs.open(naixfname);
-        if (!ofhs.good())
-        {
-            ofhs.close();
-            return Cleanup(ofs, NarcError::InvalidOutputFile);
-        }
-
-        stem = fileName.stem().string();
-        stem_upper = stem;
-        for (char &c : stem_upper)
-        { c = toupper(c); }
-
-        ofhs << "/*\n"
-                " * THIS FILE WAS AUTOMATICALLY\n"
-                " *  GENERATED BY tools/knarc\n"
-                " *      DO NOT MODIFY!!!\n"
-                " */\n"
-                "\n"
-                "#ifndef NARC_" << stem_upper << "_NAIX_\n"
-                "#define NARC_" << stem_upper << "_NAIX_\n"
-                "\n"
-                "enum {\n";
+        return NarcError::InvalidInputFile;
     }
-    vector<FileAllocationTableEntry> fatEntries;
-    uint16_t directoryCounter = 1;
 
-    WildcardVector ignore_patterns(directory / ".knarcignore");
-    ignore_patterns.push_back(".*ignore");
-    ignore_patterns.push_back(".*keep");
-    ignore_patterns.push_back(".*order");
-    WildcardVector keep_patterns(directory / ".knarckeep");
+    size_t remaining = size;
+    bool useCopyFileRange = hash == nullptr;
+    bool useSendfile = hash == nullptr && offset == nullptr;
 
-    int memberNo = 0;
-    for (const auto& de : KnarcOrderDirectoryIterator(directory, true))
+    while (remaining > 0)
     {
-        if (is_directory(de))
-        {
-            ++directoryCounter;
-        }
-        else if (keep_patterns.matches(de.path().filename().string()) || !ignore_patterns.matches(de.path().filename().string()))
+        ssize_t copied = -1;
+
+        if (useCopyFileRange)
         {
-            if (debug) {
-                cerr << "DEBUG: adding file " << de.path() << endl;
-            }
-            if (output_header)
-            {
-                string de_stem = de.path().filename().string();
-                std::replace(de_stem.begin(), de_stem.end(), '.', '_');
-                ofhs << "\tNARC_" << stem << "_" << de_stem << " = " << (memberNo++) << ",\n";
-            }
-            fatEntries.push_back(FileAllocationTableEntry
-                {
-                    .Start = 0x0,
-                    .End = 0x0
-                });
+            copied = copy_file_range(inFd, nullptr, outFd, offset, remaining, 0);
 
-            if (fatEntries.size() > 1)
+            if (copied < 0)
             {
-                fatEntries.back().Start = fatEntries.rbegin()[1].End;
-
-                if ((fatEntries.rbegin()[1].End % 4) != 0)
-                {
-                    fatEntries.back().Start += 4 - (fatEntries.rbegin()[1].End % 4);
-                }
+                useCopyFileRange = false;
+                continue;
             }
-
-            fatEntries.back().End = fatEntries.back().Start + static_cast<uint32_t>(file_size(de));
-        }
-    }
-    if (output_header)
-    {
-        ofhs << "};\n\n#endif //NARC_" << stem_upper << "_NAIX_\n";
-        ofhs.close();
-    }
-
-    FileAllocationTable fat
-    {
-        .Id = 0x46415442, // BTAF
-        .ChunkSize = static_cast<uint32_t>(sizeof(FileAllocationTable) + ((uint32_t)fatEntries.size() * sizeof(FileAllocationTableEntry))),
-        .FileCount = static_cast<uint16_t>(fatEntries.size()),
-        .Reserved = 0x0
-    };
-
-    map<fs::path, string> subTables;
-    vector<fs::path> paths;
-
-    directoryCounter = 0;
-
-    for (const auto& de : KnarcOrderDirectoryIterator(directory, true))
-    {
-        if (!subTables.count(de.path().parent_path()) && (keep_patterns.matches(de.path().filename().string()) || !ignore_patterns.matches(de.path().filename().string())))
-        {
-            subTables.insert({ de.path().parent_path(), "" });
-            paths.push_back(de.path().parent_path());
         }
-
-        if (is_directory(de))
+        else if (useSendfile)
         {
-            ++directoryCounter;
+            copied = sendfile(outFd, inFd, nullptr, remaining);
 
-            subTables[de.path().parent_path()] += static_cast<uint8_t>(0x80 + de.path().filename().string().size());
-            subTables[de.path().parent_path()] += de.path().filename().string();
-            subTables[de.path().parent_path()] += (0xF000 + directoryCounter) & 0xFF;
-            subTables[de.path().parent_path()] += (0xF000 + directoryCounter) >> 8;
+            if (copied < 0)
+            {
+                useSendfile = false;
+                continue;
+            }
         }
-        else if (keep_patterns.matches(de.path().filename().string()) || !ignore_patterns.matches(de.path().filename().string()))
+        else
         {
-            subTables[de.path().parent_path()] += static_cast<uint8_t>(de.path().filename().string().size());
-            subTables[de.path().parent_path()] += de.path().filename().string();
-        }
-    }
+            char buffer[CopyBufferSize];
 
-    for (auto& subTable : subTables)
-    {
-        subTable.second += '\0';
-    }
-
-    vector<FileNameTableEntry> fntEntries;
+            copied = read(inFd, buffer, min(remaining, sizeof(buffer)));
 
-    if (!pack_no_fnt)
-    {
-        fntEntries.push_back(
+            if (copied > 0)
             {
-                .Offset = static_cast<uint32_t>((directoryCounter + 1) * sizeof(FileNameTableEntry)),
-                .FirstFileId = 0x0,
-                .Utility = static_cast<uint16_t>(directoryCounter + 1)
-            });
-
-        for (uint16_t i = 0; i < directoryCounter; ++i)
-        {
-            fntEntries.push_back(
+                if (hash)
                 {
-                    .Offset = static_cast<uint32_t>(fntEntries.back().Offset + subTables[paths[i]].size()),
-                    .FirstFileId = fntEntries.back().FirstFileId,
-                    .Utility = 0x0
-                });
+                    hash->Update(buffer, copied);
+                }
 
-            for (size_t j = 0; j < (subTables[paths[i]].size() - 1); ++j)
-            {
-                if (static_cast<uint8_t>(subTables[paths[i]][j]) <= 0x7F)
+                ssize_t written = offset ? pwrite(outFd, buffer, copied, *offset) : write(outFd, buffer, copied);
+
+                if (written != copied)
                 {
-                    j += static_cast<uint8_t>(subTables[paths[i]][j]);
-                    ++fntEntries.back().FirstFileId;
+                    close(inFd);
+                    return NarcError::InvalidOutputFile;
                 }
-                else if (static_cast<uint8_t>(subTables[paths[i]][j]) <= 0xFF)
+
+                if (offset)
                 {
-                    j += static_cast<uint8_t>(subTables[paths[i]][j]) - 0x80 + 0x2;
+                    *offset += copied;
                 }
             }
-
-            fntEntries.back().Utility = 0xF000 + (find(paths.begin(), paths.end(), paths[i + 1].parent_path()) - paths.begin());
         }
-    }
-    else
-    {
-        fntEntries.push_back(
-            {
-                .Offset = 0x4,
-                .FirstFileId = 0x0,
-                .Utility = 0x1
-            });
-    }
-
-    FileNameTable fnt
-    {
-        .Id = 0x464E5442, // BTNF
-        .ChunkSize = static_cast<uint32_t>(sizeof(FileNameTable) + (fntEntries.size() * sizeof(FileNameTableEntry)))
-    };
 
-    if (!pack_no_fnt)
-    {
-        for (const auto& subTable : subTables)
+        // The source shrank since it was scanned
+        if (copied <= 0)
         {
-            fnt.ChunkSize += subTable.second.size();
+            close(inFd);
+            return NarcError::InvalidInputFile;
         }
-    }
 
-    if ((fnt.ChunkSize % 4) != 0)
-    {
-        fnt.ChunkSize += 4 - (fnt.ChunkSize % 4);
+        remaining -= copied;
     }
 
-    FileImages fi
-    {
-        .Id = 0x46494D47, // GMIF
-        .ChunkSize = static_cast<uint32_t>(sizeof(FileImages) + (fatEntries.empty() ? 0 : fatEntries.back().End))
-    };
+    close(inFd);
 
-    if ((fi.ChunkSize % 4) != 0)
+    return NarcError::None;
+}
+
+// Pads the image that ends at position out to a dword boundary, at *offset if given
+static NarcError PadMember(int outFd, off_t position, off_t* offset)
+{
+    if ((position % 4) == 0)
     {
-        fi.ChunkSize += 4 - (fi.ChunkSize % 4);
+        return NarcError::None;
     }
 
-    Header header
-    {
-        .Id = 0x4352414E, // NARC
-        .ByteOrderMark = 0xFFFE,
-        .Version = 0x100,
-        .FileSize = static_cast<uint32_t>(sizeof(Header) + fat.ChunkSize + fnt.ChunkSize + fi.ChunkSize),
-        .ChunkSize = sizeof(Header),
-        .ChunkCount = 0x3
-    };
+    const char padding[4] = { '\xFF', '\xFF', '\xFF', '\xFF' };
+    size_t length = 4 - (position % 4);
+    ssize_t written = offset ? pwrite(outFd, padding, length, *offset) : write(outFd, padding, length);
+
+    return written == static_cast<ssize_t>(length) ? NarcError::None : NarcError::InvalidOutputFile;
+}
+#endif
 
-    ofs.write(reinterpret_cast<char*>(&header), sizeof(Header));
-    ofs.write(reinterpret_cast<char*>(&fat), sizeof(FileAllocationTable));
+// Size, modification time in nanoseconds and inode of a file, from a single stat where possible
+static bool StatFile(const fs::path& path, uint64_t& size, int64_t& modifiedTime, uint64_t& inode)
+{
+#if defined(__unix__) || defined(__APPLE__)
+    struct stat st;
 
-    for (auto& entry : fatEntries)
+    if (stat(path.c_str(), &st) != 0)
     {
-        ofs.write(reinterpret_cast<char*>(&entry), sizeof(FileAllocationTableEntry));
+        return false;
     }
 
-    ofs.write(reinterpret_cast<char*>(&fnt), sizeof(FileNameTable));
+    size = static_cast<uint64_t>(st.st_size);
+    inode = static_cast<uint64_t>(st.st_ino);
+#ifdef __APPLE__
+    modifiedTime = static_cast<int64_t>(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    modifiedTime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+
+    return true;
+#else
+    error_code ec;
+
+    size = fs::file_size(path, ec);
+    modifiedTime = static_cast<int64_t>(fs::last_write_time(path, ec).time_since_epoch().count());
+    inode = 0;
+
+    return !ec;
+#endif
+}
+
+// Numbers the directories holding included entries and points every entry at its parent's
+static void IndexDirectories(PackManifest& manifest)
+{
+    map<fs::path, uint16_t> directoryIds;
 
-    for (auto& entry : fntEntries)
+    // FNT subtables are laid out in the order their first included entry is found
+    for (const auto& entry : manifest.Entries)
     {
-        ofs.write(reinterpret_cast<char*>(&entry), sizeof(FileNameTableEntry));
+        if (entry.Included && directoryIds.insert({ entry.Path.parent_path(), static_cast<uint16_t>(manifest.Directories.size()) }).second)
+        {
+            manifest.Directories.push_back(entry.Path.parent_path());
+        }
     }
 
-    if (!pack_no_fnt)
+    for (auto& entry : manifest.Entries)
     {
-        for (const auto& path : paths)
+        auto it = directoryIds.find(entry.Path.parent_path());
+
+        if (it != directoryIds.end())
         {
-            ofs << subTables[path];
+            entry.ParentId = it->second;
         }
     }
+}
 
-    AlignDword(ofs, 0xFF);
+PackManifest Narc::BuildPackManifest(const fs::path& directory) const
+{
+    ProfileScope scope(options.Profile, "scan");
+    PackManifest manifest;
+
+    PatternMatcher ignore_patterns(directory / ".knarcignore");
+    ignore_patterns.Add(".*ignore");
+    ignore_patterns.Add(".*keep");
+    ignore_patterns.Add(".*order");
+    PatternMatcher keep_patterns(directory / ".knarckeep");
 
-    ofs.write(reinterpret_cast<char*>(&fi), sizeof(FileImages));
+    // Patterns only ever see the filename, so each distinct name is matched once
+    unordered_map<string, bool> verdicts;
 
     for (const auto& de : KnarcOrderDirectoryIterator(directory, true))
     {
-        if (is_directory(de))
-        {
-            continue;
-        }
+        string name = de.path().filename().string();
+        auto verdict = verdicts.find(name);
 
-        if (!(keep_patterns.matches(de.path().filename().string()) || !ignore_patterns.matches(de.path().filename().string())))
+        if (verdict == verdicts.end())
         {
-            continue;
+            ProfileScope matching(options.Profile, "match", false);
+            Count(options.Profile, Counter::PatternMatches);
+
+            verdict = verdicts.insert({ name, keep_patterns.Matches(name) || !ignore_patterns.Matches(name) }).first;
         }
 
-        ifstream ifs(de.path(), ios::binary | ios::ate);
+        manifest.Entries.push_back(PackEntry
+            {
+                .Path = de.path(),
+                .IsDirectory = de.is_directory(),
+                .Included = verdict->second,
+                .ParentId = 0xFFFF,
+                .Size = 0,
+                .ModifiedTime = 0,
+                .Inode = 0,
+                .InMemory = false,
+                .Data = { nullptr, 0 }
+            });
+
+        PackEntry& entry = manifest.Entries.back();
 
-        if (!ifs.good())
+        if (!entry.IsDirectory)
         {
-            ifs.close();
-
-            return Cleanup(ofs, NarcError::InvalidInputFile);
+            Count(options.Profile, Counter::StatCalls);
         }
 
-        streampos length = ifs.tellg();
-        unique_ptr<char[]> buffer = make_unique<char[]>(static_cast<unsigned int>(length));
-
-        ifs.seekg(0);
-        ifs.read(buffer.get(), length);
-        ifs.close();
-
-        ofs.write(buffer.get(), length);
+        if (!entry.IsDirectory && options.UseCache)
+        {
+            // One stat gives the cache everything it compares
+            uint64_t size = 0;
+            StatFile(entry.Path, size, entry.ModifiedTime, entry.Inode);
+            entry.Size = static_cast<uint32_t>(size);
+        }
+        else if (!entry.IsDirectory)
+        {
+            entry.Size = static_cast<uint32_t>(de.file_size());
+        }
 
-        AlignDword(ofs, 0xFF);
     }
 
-    ofs.close();
+    IndexDirectories(manifest);
 
-    return error == NarcError::None ? true : false;
+    return manifest;
 }
 
-bool Narc::Unpack(const fs::path& fileName, const fs::path& directory)
+// Lays in-memory members out the way a directory walk would: each directory's files in the order
+// given, then its subdirectories, depth first, in the order they first come up. The filename
+// table needs each directory's files to be contiguous; without one, an index is all a member
+// has to go by, so members keep the order they were given in.
+PackManifest Narc::BuildMemoryManifest(const vector<MemberView>& members) const
 {
-    ifstream ifs(fileName, ios::binary);
+    struct Node
+    {
+        vector<size_t> Files;
+        vector<fs::path> Children;
+    };
 
-    if (!ifs.good()) { return Cleanup(ifs, NarcError::InvalidInputFile); }
+    map<fs::path, Node> tree;
+    vector<fs::path> paths;
 
-    Header header;
-    ifs.read(reinterpret_cast<char*>(&header), sizeof(Header));
+    tree[fs::path()];
 
-    if (header.Id != 0x4352414E) { return Cleanup(ifs, NarcError::InvalidHeaderId); }
-    if (header.ByteOrderMark != 0xFFFE) { return Cleanup(ifs, NarcError::InvalidByteOrderMark); }
-    if ((header.Version != 0x0100) && (header.Version != 0x0000)) { return Cleanup(ifs, NarcError::InvalidVersion); }
-    if (header.ChunkSize != 0x10) { return Cleanup(ifs, NarcError::InvalidHeaderSize); }
-    if (header.ChunkCount != 0x3) { return Cleanup(ifs, NarcError::InvalidChunkCount); }
+    for (size_t i = 0; i < members.size(); ++i)
+    {
+        paths.push_back(members[i].Path.lexically_normal().relative_path());
 
-    FileAllocationTable fat;
-    ifs.read(reinterpret_cast<char*>(&fat), sizeof(FileAllocationTable));
+        fs::path parent = paths.back().parent_path();
+        vector<fs::path> missing;
 
-    if (fat.Id != 0x46415442) { return Cleanup(ifs, NarcError::InvalidFileAllocationTableId); }
-    if (fat.Reserved != 0x0) { return Cleanup(ifs, NarcError::InvalidFileAllocationTableReserved); }
+        for (fs::path dir = parent; !dir.empty() && !tree.count(dir); dir = dir.parent_path())
+        {
+            missing.push_back(dir);
+        }
 
-    unique_ptr<FileAllocationTableEntry[]> fatEntries = make_unique<FileAllocationTableEntry[]>(fat.FileCount);
+        for (auto it = missing.rbegin(); it != missing.rend(); ++it)
+        {
+            tree[it->parent_path()].Children.push_back(*it);
+            tree[*it];
+        }
 
-    for (uint16_t i = 0; i < fat.FileCount; ++i)
-    {
-        ifs.read(reinterpret_cast<char*>(&fatEntries.get()[i]), sizeof(FileAllocationTableEntry));
+        tree[parent].Files.push_back(i);
     }
 
-    FileNameTable fnt;
-    vector<FileNameTableEntry> FileNameTableEntries;
-    ifs.read(reinterpret_cast<char*>(&fnt), sizeof(FileNameTable));
-
-    if (fnt.Id != 0x464E5442) { return Cleanup(ifs, NarcError::InvalidFileNameTableId); }
+    PackManifest manifest;
 
-    vector<FileNameTableEntry> fntEntries;
-
-    do
+    auto addFile = [&](size_t i)
     {
-        fntEntries.push_back(FileNameTableEntry());
-
-        ifs.read(reinterpret_cast<char*>(&fntEntries.back().Offset), sizeof(uint32_t));
-        ifs.read(reinterpret_cast<char*>(&fntEntries.back().FirstFileId), sizeof(uint16_t));
-        ifs.read(reinterpret_cast<char*>(&fntEntries.back().Utility), sizeof(uint16_t));
-    } while (static_cast<uint32_t>(ifs.tellg()) < (header.ChunkSize + fat.ChunkSize + sizeof(FileNameTable) + fntEntries[0].Offset));
-
-    unique_ptr<string[]> fileNames = make_unique<string[]>(0xFFFF);
+        manifest.Entries.push_back(PackEntry
+            {
+                .Path = paths[i],
+                .IsDirectory = false,
+                .Included = true,
+                .ParentId = 0xFFFF,
+                .Size = static_cast<uint32_t>(members[i].Data.Size),
+                .ModifiedTime = 0,
+                .Inode = 0,
+                .InMemory = true,
+                .Data = members[i].Data
+            });
+    };
 
-    for (size_t i = 0; i < fntEntries.size(); ++i)
+    function<void(const fs::path&)> walk = [&](const fs::path& dir)
     {
-        ifs.seekg(static_cast<uint64_t>(header.ChunkSize) + fat.ChunkSize + sizeof(FileNameTable) + fntEntries[i].Offset);
+        const Node& node = tree[dir];
 
-        uint16_t fileId = 0x0000;
+        for (size_t i : node.Files)
+        {
+            addFile(i);
+        }
 
-        for (uint8_t length = 0x80; length != 0x00; ifs.read(reinterpret_cast<char*>(&length), sizeof(uint8_t)))
+        for (const auto& child : node.Children)
         {
-            if (length <= 0x7F)
-            {
-                for (uint8_t j = 0; j < length; ++j)
+            manifest.Entries.push_back(PackEntry
                 {
-                    uint8_t c;
-                    ifs.read(reinterpret_cast<char*>(&c), sizeof(uint8_t));
+                    .Path = child,
+                    .IsDirectory = true,
+                    .Included = true,
+                    .ParentId = 0xFFFF,
+                    .Size = 0,
+                    .ModifiedTime = 0,
+                    .Inode = 0,
+                    .InMemory = true,
+                    .Data = { nullptr, 0 }
+                });
 
-                    fileNames.get()[fntEntries[i].FirstFileId + fileId] += c;
-                }
+            walk(child);
+        }
+    };
 
-                ++fileId;
-            }
-            else if (length == 0x80)
+    if (options.PackNoFnt)
+    {
+        for (size_t i = 0; i < members.size(); ++i)
+        {
+            addFile(i);
+        }
+    }
+    else
+    {
+        walk(fs::path());
+    }
+
+    IndexDirectories(manifest);
+
+    return manifest;
+}
+
+// Gives the bytes of a member, from memory or mapped from disk; file has to outlive bytes
+static bool MapMember(const PackEntry& entry, MappedFile& file, ByteSpan& bytes)
+{
+    if (entry.InMemory)
+    {
+        bytes = entry.Data;
+
+        return true;
+    }
+
+    if (!file.Open(entry.Path) || file.Size() != entry.Size)
+    {
+        return false;
+    }
+
+    bytes = { file.Data(), file.Size() };
+
+    return true;
+}
+
+// For every member, the first member with the same bytes, which may be itself. Only members
+// sharing their size with another one are hashed, and equal hashes are confirmed byte for byte.
+// A member that cannot be read is left to itself, so writing it reports the error.
+static vector<size_t> FindIdenticalMembers(const vector<const PackEntry*>& members, unsigned int jobs)
+{
+    vector<size_t> original(members.size());
+    unordered_map<uint32_t, size_t> sizes;
+
+    for (const PackEntry* member : members)
+    {
+        ++sizes[member->Size];
+    }
+
+    vector<uint64_t> hashes(members.size(), 0);
+    vector<char> hashed(members.size(), 0);
+
+    ParallelFor(members.size(), jobs, [&](size_t i)
+        {
+            MappedFile file;
+            ByteSpan bytes;
+
+            if (sizes.find(members[i]->Size)->second > 1 && MapMember(*members[i], file, bytes))
             {
-                // Reserved
+                hashes[i] = Xxh64::Hash(bytes.Data, bytes.Size);
+                hashed[i] = 1;
             }
-            else if (length <= 0xFF)
-            {
-                length -= 0x80;
-                string directoryName;
 
-                for (uint8_t j = 0; j < length; ++j)
-                {
-                    uint8_t c;
-                    ifs.read(reinterpret_cast<char*>(&c), sizeof(uint8_t));
+            return true;
+        });
 
-                    directoryName += c;
-                }
+    unordered_map<uint64_t, vector<size_t>> candidates;
+
+    for (size_t i = 0; i < members.size(); ++i)
+    {
+        original[i] = i;
+
+        if (!hashed[i])
+        {
+            continue;
+        }
 
-                uint16_t directoryId;
-                ifs.read(reinterpret_cast<char*>(&directoryId), sizeof(uint16_t));
+        vector<size_t>& sameHash = candidates[hashes[i]];
 
-                fileNames.get()[directoryId] = directoryName;
-            }
-            else
+        for (size_t candidate : sameHash)
+        {
+            MappedFile first;
+            MappedFile second;
+            ByteSpan a;
+            ByteSpan b;
+
+            if (members[candidate]->Size == members[i]->Size
+                && MapMember(*members[candidate], first, a) && MapMember(*members[i], second, b)
+                && (a.Size == 0 || memcmp(a.Data, b.Data, a.Size) == 0))
             {
-                return Cleanup(ifs, NarcError::InvalidFileNameTableEntryId);
+                original[i] = candidate;
+                break;
             }
         }
+
+        if (original[i] == i)
+        {
+            sameHash.push_back(i);
+        }
     }
 
-    if ((ifs.tellg() % 4) != 0)
+    return original;
+}
+
+PackLayout Narc::BuildPackLayout(const PackManifest& manifest, const fs::path& fileName) const
+{
+    ProfileScope scope(options.Profile, "layout");
+    PackLayout layout;
+
+    ostringstream ofhs;
+    string stem;
+    string stem_upper;
+    // Pikalax 29 May 2021
+    // Output an includable header that enumerates the NARC contents
+    if (options.OutputHeader)
     {
-        ifs.seekg(4 - (ifs.tellg() % 4), ios::cur);
+        stem = fileName.stem().string();
+        stem_upper = stem;
+        for (char &c : stem_upper)
+        { c = toupper(c); }
+
+        ofhs << "/*\n"
+                " * THIS FILE WAS AUTOMATICALLY\n"
+                " *  GENERATED BY tools/knarc\n"
+                " *      DO NOT MODIFY!!!\n"
+                " */\n"
+                "\n"
+                "#ifndef NARC_" << stem_upper << "_NAIX_\n"
+                "#define NARC_" << stem_upper << "_NAIX_\n"
+                "\n"
+                "enum {\n";
     }
 
-    FileImages fi;
-    ifs.read(reinterpret_cast<char*>(&fi), sizeof(FileImages));
+    vector<FileAllocationTableEntry>& fatEntries = layout.FatEntries;
+    uint16_t directoryCounter = 1;
+
+    int memberNo = 0;
+    for (const auto& entry : manifest.Entries)
+    {
+        if (entry.IsDirectory)
+        {
+            ++directoryCounter;
+        }
+        else if (entry.Included)
+        {
+            if (options.Debug) {
+                DebugLine("adding file ", entry.Path);
+            }
+            if (options.OutputHeader)
+            {
+                string de_stem = entry.Path.filename().string();
+                std::replace(de_stem.begin(), de_stem.end(), '.', '_');
+                ofhs << "\tNARC_" << stem << "_" << de_stem << " = " << (memberNo++) << ",\n";
+            }
+            fatEntries.push_back(FileAllocationTableEntry
+                {
+                    .Start = 0x0,
+                    .End = 0x0
+                });
 
-    if (fi.Id != 0x46494D47) { return Cleanup(ifs, NarcError::InvalidFileImagesId); }
+            if (fatEntries.size() > 1)
+            {
+                fatEntries.back().Start = fatEntries.rbegin()[1].End;
 
-    fs::create_directory(directory);
-    fs::current_path(directory);
+                if ((fatEntries.rbegin()[1].End % 4) != 0)
+                {
+                    fatEntries.back().Start += 4 - (fatEntries.rbegin()[1].End % 4);
+                }
+            }
 
-    if (fnt.ChunkSize == 0x10)
+            fatEntries.back().End = fatEntries.back().Start + entry.Size;
+            layout.Members.push_back(&entry);
+        }
+    }
+    if (options.OutputHeader)
     {
-        for (uint16_t i = 0; i < fat.FileCount; ++i)
-        {
-            ifs.seekg(static_cast<uint64_t>(header.ChunkSize) + fat.ChunkSize + fnt.ChunkSize + 8 + fatEntries.get()[i].Start);
+        ofhs << "};\n\n#endif //NARC_" << stem_upper << "_NAIX_\n";
+        layout.Naix = ofhs.str();
+    }
 
-            unique_ptr<char[]> buffer = make_unique<char[]>(fatEntries.get()[i].End - fatEntries.get()[i].Start);
-            ifs.read(buffer.get(), fatEntries.get()[i].End - fatEntries.get()[i].Start);
+    layout.Duplicate.assign(fatEntries.size(), 0);
 
-            ostringstream oss;
-            oss << fileName.stem().string() << "_" << setfill('0') << setw(8) << i << ".bin";
+    if (options.Deduplicate)
+    {
+        ProfileScope deduplicating(options.Profile, "dedup");
 
-            ofstream ofs(oss.str(), ios::binary);
+        // Duplicates take no room in GMIF, so everything after the first one moves down
+        vector<size_t> original = FindIdenticalMembers(layout.Members, options.Jobs);
+        uint32_t end = 0;
 
-            if (!ofs.good())
+        for (size_t i = 0; i < fatEntries.size(); ++i)
+        {
+            if (original[i] != i)
             {
-                ofs.close();
+                if (options.Debug) {
+                    DebugLine(layout.Members[i]->Path, " shares the image of ", layout.Members[original[i]]->Path);
+                }
 
-                return Cleanup(ifs, NarcError::InvalidOutputFile);
+                fatEntries[i] = fatEntries[original[i]];
+                layout.Duplicate[i] = 1;
+
+                continue;
             }
 
-            ofs.write(buffer.get(), fatEntries.get()[i].End - fatEntries.get()[i].Start);
-            ofs.close();
+            fatEntries[i].Start = end + ((4 - (end % 4)) % 4);
+            fatEntries[i].End = fatEntries[i].Start + layout.Members[i]->Size;
+            end = fatEntries[i].End;
         }
     }
-    else
+
+    FileAllocationTable& fat = layout.Fat;
+
+    fat =
     {
-        fs::path absolutePath = fs::absolute(fs::current_path());
+        .Id = 0x46415442, // BTAF
+        .ChunkSize = static_cast<uint32_t>(sizeof(FileAllocationTable) + ((uint32_t)fatEntries.size() * sizeof(FileAllocationTableEntry))),
+        .FileCount = static_cast<uint16_t>(fatEntries.size()),
+        .Reserved = 0x0
+    };
+
+    const vector<fs::path>& paths = manifest.Directories;
+    vector<string>& subTables = layout.SubTables;
+
+    subTables.resize(paths.size());
+
+    directoryCounter = 0;
 
-        for (size_t i = 0; i < fntEntries.size(); ++i)
+    for (const auto& entry : manifest.Entries)
+    {
+        if (entry.IsDirectory)
         {
-            fs::current_path(absolutePath);
-            stack<string> directories;
+            ++directoryCounter;
 
-            for (uint16_t j = fntEntries[i].Utility; j > 0xF000; j = fntEntries[j - 0xF000].Utility)
+            if (entry.ParentId == 0xFFFF)
             {
-                directories.push(fileNames.get()[j]);
+                // Nothing from the parent directory was packed, so there is no subtable to list it in
+                continue;
             }
 
-            for (; !directories.empty(); directories.pop())
+            string name = entry.Path.filename().string();
+            string& subTable = subTables[entry.ParentId];
+
+            subTable += static_cast<uint8_t>(0x80 + name.size());
+            subTable += name;
+            subTable += (0xF000 + directoryCounter) & 0xFF;
+            subTable += (0xF000 + directoryCounter) >> 8;
+        }
+        else if (entry.Included)
+        {
+            string name = entry.Path.filename().string();
+            string& subTable = subTables[entry.ParentId];
+
+            subTable += static_cast<uint8_t>(name.size());
+            subTable += name;
+        }
+    }
+
+    for (auto& subTable : subTables)
+    {
+        subTable += '\0';
+    }
+
+    vector<FileNameTableEntry>& fntEntries = layout.FntEntries;
+
+    if (!options.PackNoFnt)
+    {
+        fntEntries.push_back(
             {
-                fs::create_directory(directories.top());
-                fs::current_path(directories.top());
-            }
+                .Offset = static_cast<uint32_t>((directoryCounter + 1) * sizeof(FileNameTableEntry)),
+                .FirstFileId = 0x0,
+                .Utility = static_cast<uint16_t>(directoryCounter + 1)
+            });
+
+        for (uint16_t i = 0; i < directoryCounter; ++i)
+        {
+            fntEntries.push_back(
+                {
+                    .Offset = static_cast<uint32_t>(fntEntries.back().Offset + subTables[i].size()),
+                    .FirstFileId = fntEntries.back().FirstFileId,
+                    .Utility = 0x0
+                });
 
-            if (fntEntries[i].Utility >= 0xF000)
+            for (size_t j = 0; j < (subTables[i].size() - 1); ++j)
             {
-                fs::create_directory(fileNames.get()[0xF000 + i]);
-                fs::current_path(fileNames.get()[0xF000 + i]);
+                if (static_cast<uint8_t>(subTables[i][j]) <= 0x7F)
+                {
+                    j += static_cast<uint8_t>(subTables[i][j]);
+                    ++fntEntries.back().FirstFileId;
+                }
+                else if (static_cast<uint8_t>(subTables[i][j]) <= 0xFF)
+                {
+                    j += static_cast<uint8_t>(subTables[i][j]) - 0x80 + 0x2;
+                }
             }
 
-            ifs.seekg(static_cast<uint64_t>(header.ChunkSize) + fat.ChunkSize + sizeof(FileNameTable) + fntEntries[i].Offset);
+            fntEntries.back().Utility = 0xF000 + (find(paths.begin(), paths.end(), paths[i + 1].parent_path()) - paths.begin());
+        }
+    }
+    else
+    {
+        fntEntries.push_back(
+            {
+                .Offset = 0x4,
+                .FirstFileId = 0x0,
+                .Utility = 0x1
+            });
+    }
+
+    FileNameTable& fnt = layout.Fnt;
 
-            uint16_t fileId = 0x0000;
+    fnt =
+    {
+        .Id = 0x464E5442, // BTNF
+        .ChunkSize = static_cast<uint32_t>(sizeof(FileNameTable) + (fntEntries.size() * sizeof(FileNameTableEntry)))
+    };
 
-            for (uint8_t length = 0x80; length != 0x00; ifs.read(reinterpret_cast<char*>(&length), sizeof(uint8_t)))
-            {
-                if (length <= 0x7F)
-                {
-                    streampos savedPosition = ifs.tellg();
+    if (!options.PackNoFnt)
+    {
+        for (const auto& subTable : subTables)
+        {
+            fnt.ChunkSize += subTable.size();
+        }
+    }
+
+    if ((fnt.ChunkSize % 4) != 0)
+    {
+        fnt.ChunkSize += 4 - (fnt.ChunkSize % 4);
+    }
 
-                    ifs.seekg(static_cast<uint64_t>(header.ChunkSize) + fat.ChunkSize + fnt.ChunkSize + 8 + fatEntries.get()[fntEntries[i].FirstFileId + fileId].Start);
+    uint32_t imagesEnd = 0;
 
-                    unique_ptr<char[]> buffer = make_unique<char[]>(fatEntries.get()[fntEntries[i].FirstFileId + fileId].End - fatEntries.get()[fntEntries[i].FirstFileId + fileId].Start);
-                    ifs.read(buffer.get(), fatEntries.get()[fntEntries[i].FirstFileId + fileId].End - fatEntries.get()[fntEntries[i].FirstFileId + fileId].Start);
+    for (const auto& entry : fatEntries)
+    {
+        imagesEnd = max(imagesEnd, entry.End);
+    }
 
-                    ofstream ofs(fileNames.get()[fntEntries[i].FirstFileId + fileId], ios::binary);
+    FileImages& fi = layout.Fi;
 
-                    if (!ofs.good())
-                    {
-                        ofs.close();
+    fi =
+    {
+        .Id = 0x46494D47, // GMIF
+        .ChunkSize = static_cast<uint32_t>(sizeof(FileImages) + imagesEnd)
+    };
 
-                        return Cleanup(ifs, NarcError::InvalidOutputFile);
-                    }
+    if ((fi.ChunkSize % 4) != 0)
+    {
+        fi.ChunkSize += 4 - (fi.ChunkSize % 4);
+    }
+
+    layout.ArchiveHeader =
+    {
+        .Id = 0x4352414E, // NARC
+        .ByteOrderMark = 0xFFFE,
+        .Version = 0x100,
+        .FileSize = static_cast<uint32_t>(sizeof(Header) + fat.ChunkSize + fnt.ChunkSize + fi.ChunkSize),
+        .ChunkSize = sizeof(Header),
+        .ChunkCount = 0x3
+    };
+
+    return layout;
+}
+
+// Five segments however many members and directories there are: the header and FAT header,
+// the FAT entries, the FNT header, the FNT entries, and the subtables through the GMIF header
+void Narc::WriteMetadata(GatherWriter& out, const PackLayout& layout)
+{
+    out.Append(&layout.ArchiveHeader, sizeof(Header));
+    out.Append(&layout.Fat, sizeof(FileAllocationTable));
+    out.Reference(layout.FatEntries.data(), layout.FatEntries.size() * sizeof(FileAllocationTableEntry));
+    out.Append(&layout.Fnt, sizeof(FileNameTable));
+    out.Reference(layout.FntEntries.data(), layout.FntEntries.size() * sizeof(FileNameTableEntry));
+
+    if (!options.PackNoFnt)
+    {
+        for (const auto& subTable : layout.SubTables)
+        {
+            out.Append(subTable.data(), subTable.size());
+        }
+    }
+
+    out.Align(4, 0xFF);
+    out.Append(&layout.Fi, sizeof(FileImages));
+}
+
+// What writing the whole archive reads and writes, for --stats
+static void CountArchive(Profiler* profiler, const PackLayout& layout)
+{
+    if (!profiler)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < layout.Members.size(); ++i)
+    {
+        if (!layout.Duplicate[i] && !layout.Members[i]->InMemory)
+        {
+            profiler->Add(Counter::FilesRead, 1);
+            profiler->Add(Counter::BytesRead, layout.Members[i]->Size);
+        }
+    }
 
-                    ofs.write(buffer.get(), fatEntries.get()[fntEntries[i].FirstFileId + fileId].End - fatEntries.get()[fntEntries[i].FirstFileId + fileId].Start);
-                    ofs.close();
+    profiler->Add(Counter::FilesWritten, 1);
+    profiler->Add(Counter::BytesWritten, layout.ArchiveHeader.FileSize);
+}
+
+bool Narc::WriteArchive(const fs::path& fileName, const PackLayout& layout, vector<uint64_t>* hashes)
+{
+#ifdef __linux__
+    ProfileScope scope(options.Profile, "write");
+
+    // The metadata goes out in one gather write. Member bytes then go from each source fd
+    // straight into the output fd without passing through user space; only the alignment
+    // padding is written from here.
+    int fd = open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    GatherWriter metadata;
+
+    WriteMetadata(metadata, layout);
+
+    off_t imagesStart = static_cast<off_t>(metadata.Position());
+
+    if (fd < 0 || !metadata.Flush(fd))
+    {
+        if (fd >= 0) { close(fd); }
+
+        error = NarcError::InvalidOutputFile;
+
+        return false;
+    }
+
+    const vector<const PackEntry*>& members = layout.Members;
+    const vector<FileAllocationTableEntry>& fatEntries = layout.FatEntries;
+
+    if (hashes)
+    {
+        hashes->assign(members.size(), 0);
+    }
 
-                    ifs.seekg(savedPosition);
-                    ifs.seekg(length, ios::cur);
+    // Every image's final offset is already known from the FAT, so with more than one worker the
+    // output is sized up front and each member is written at its own offset, in any order
+    bool positional = options.Jobs > 1 && members.size() > 1
+        && (fallocate(fd, 0, 0, layout.ArchiveHeader.FileSize) == 0 || ftruncate(fd, layout.ArchiveHeader.FileSize) == 0);
 
-                    ++fileId;
+    if (positional)
+    {
+        atomic<NarcError> firstError(NarcError::None);
+
+        ParallelFor(members.size(), options.Jobs, [&](size_t i)
+            {
+                if (layout.Duplicate[i])
+                {
+                    return true;
                 }
-                else if (length == 0x80)
+
+                off_t offset = imagesStart + fatEntries[i].Start;
+                Xxh64 hash;
+                NarcError e = CopyMember(fd, members[i]->Path, members[i]->Size, &offset, hashes ? &hash : nullptr);
+
+                if (hashes)
                 {
-                    // Reserved
+                    (*hashes)[i] = hash.Digest();
                 }
-                else if (length <= 0xFF)
+
+                if (e == NarcError::None)
                 {
-                    ifs.seekg(static_cast<uint64_t>(length) - 0x80 + 0x2, ios::cur);
+                    e = PadMember(fd, offset, &offset);
                 }
-                else
+
+                if (e != NarcError::None)
                 {
-                    return Cleanup(ifs, NarcError::InvalidFileNameTableEntryId);
+                    NarcError none = NarcError::None;
+                    firstError.compare_exchange_strong(none, e);
+
+                    return false;
                 }
-            }
-        }
-    }
 
-    ifs.close();
+                return true;
+            });
 
-    return error == NarcError::None ? true : false;
+        error = firstError;
+    }
+    else
+    {
+        off_t position = imagesStart;
+
+        for (size_t i = 0; i < members.size(); ++i)
+        {
+            const PackEntry* member = members[i];
+
+            if (layout.Duplicate[i])
+            {
+                continue;
+            }
+
+            Xxh64 hash;
+            error = CopyMember(fd, member->Path, member->Size, nullptr, hashes ? &hash : nullptr);
+
+            if (hashes)
+            {
+                (*hashes)[i] = hash.Digest();
+            }
+
+            if (error == NarcError::None)
+            {
+                position += member->Size;
+                error = PadMember(fd, position, nullptr);
+                position += (4 - (position % 4)) % 4;
+            }
+
+            if (error != NarcError::None)
+            {
+                break;
+            }
+        }
+    }
+
+    if (error != NarcError::None)
+    {
+        close(fd);
+
+        return false;
+    }
+
+    close(fd);
+
+    CountArchive(options.Profile, layout);
+#else
+    ofstream ofs(fileName, ios::binary);
+
+    if (!ofs.good()) { return Cleanup(ofs, NarcError::InvalidOutputFile); }
+
+    StreamSink sink(ofs);
+
+    if (!WriteArchive(sink, layout, hashes)) { return Cleanup(ofs, error); }
+
+    ofs.close();
+#endif
+
+    return error == NarcError::None ? true : false;
+}
+
+// In-memory members are only referenced, so the whole archive goes to the sink in one flush
+// unless some members have to be read from disk
+bool Narc::WriteArchive(ByteSink& sink, const PackLayout& layout, vector<uint64_t>* hashes)
+{
+    ProfileScope scope(options.Profile, "write");
+    GatherWriter out;
+    unique_ptr<char[]> buffer;
+
+    if (hashes)
+    {
+        hashes->assign(layout.Members.size(), 0);
+    }
+
+    WriteMetadata(out, layout);
+
+    for (size_t i = 0; i < layout.Members.size(); ++i)
+    {
+        const PackEntry& entry = *layout.Members[i];
+
+        if (layout.Duplicate[i])
+        {
+            continue;
+        }
+
+        Xxh64 hash;
+
+        if (entry.InMemory)
+        {
+            out.Reference(entry.Data.Data, entry.Data.Size);
+
+            if (hashes)
+            {
+                hash.Update(entry.Data.Data, entry.Data.Size);
+            }
+        }
+        else
+        {
+            ifstream ifs(entry.Path, ios::binary);
+
+            if (!ifs.good())
+            {
+                error = NarcError::InvalidInputFile;
+
+                return false;
+            }
+
+            if (!out.Flush(sink))
+            {
+                error = NarcError::InvalidOutputFile;
+
+                return false;
+            }
+
+            if (!buffer)
+            {
+                buffer = make_unique<char[]>(CopyBufferSize);
+            }
+
+            for (uint32_t remaining = entry.Size; remaining > 0; )
+            {
+                uint32_t length = min<uint32_t>(remaining, CopyBufferSize);
+
+                if (!ifs.read(buffer.get(), length))
+                {
+                    error = NarcError::InvalidInputFile;
+
+                    return false;
+                }
+
+                if (!sink.Write(buffer.get(), length))
+                {
+                    error = NarcError::InvalidOutputFile;
+
+                    return false;
+                }
+
+                if (hashes)
+                {
+                    hash.Update(buffer.get(), length);
+                }
+
+                remaining -= length;
+            }
+
+            out.Advance(entry.Size);
+        }
+
+        if (hashes)
+        {
+            (*hashes)[i] = hash.Digest();
+        }
+
+        out.Align(4, 0xFF);
+    }
+
+    if (!out.Flush(sink))
+    {
+        error = NarcError::InvalidOutputFile;
+
+        return false;
+    }
+
+    CountArchive(options.Profile, layout);
+
+    return true;
+}
+
+bool Narc::PatchArchive(const fs::path& fileName, const PackLayout& layout, bool metadataDirty, const vector<char>& dirty, vector<uint64_t>* hashes)
+{
+#ifdef __linux__
+    ProfileScope scope(options.Profile, "patch");
+
+    if (hashes)
+    {
+        hashes->assign(layout.Members.size(), 0);
+    }
+
+    // Opened without truncating, so the images that are still in place survive
+    int fd = open(fileName.c_str(), O_WRONLY);
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        if (fd >= 0) { close(fd); }
+
+        error = NarcError::InvalidOutputFile;
+
+        return false;
+    }
+
+    if (metadataDirty)
+    {
+        GatherWriter metadata;
+
+        WriteMetadata(metadata, layout);
+        Count(options.Profile, Counter::BytesWritten, metadata.Position());
+
+        if (!metadata.FlushAt(fd, 0))
+        {
+            close(fd);
+
+            error = NarcError::InvalidOutputFile;
+
+            return false;
+        }
+    }
+
+    off_t imagesStart = sizeof(Header) + layout.Fat.ChunkSize + layout.Fnt.ChunkSize + sizeof(FileImages);
+    atomic<NarcError> firstError(NarcError::None);
+
+    ParallelFor(layout.Members.size(), options.Jobs, [&](size_t i)
+        {
+            // A duplicate's bytes are already those of the image it shares
+            if (!dirty[i] || layout.Duplicate[i])
+            {
+                return true;
+            }
+
+            off_t offset = imagesStart + layout.FatEntries[i].Start;
+            Xxh64 hash;
+            NarcError e = CopyMember(fd, layout.Members[i]->Path, layout.Members[i]->Size, &offset, hashes ? &hash : nullptr);
+
+            if (hashes)
+            {
+                (*hashes)[i] = hash.Digest();
+            }
+
+            if (e == NarcError::None)
+            {
+                e = PadMember(fd, offset, &offset);
+
+                Count(options.Profile, Counter::FilesRead);
+                Count(options.Profile, Counter::BytesRead, layout.Members[i]->Size);
+                Count(options.Profile, Counter::BytesWritten, layout.Members[i]->Size);
+            }
+
+            if (e != NarcError::None)
+            {
+                NarcError none = NarcError::None;
+                firstError.compare_exchange_strong(none, e);
+
+                return false;
+            }
+
+            return true;
+        });
+
+    error = firstError;
+
+    if (error == NarcError::None && st.st_size != static_cast<off_t>(layout.ArchiveHeader.FileSize) && ftruncate(fd, layout.ArchiveHeader.FileSize) != 0)
+    {
+        error = NarcError::InvalidOutputFile;
+    }
+
+    close(fd);
+
+    return error == NarcError::None ? true : false;
+#else
+    return WriteArchive(fileName, layout, hashes);
+#endif
+}
+
+static uint64_t ImageRange(const FileAllocationTableEntry& entry)
+{
+    return (static_cast<uint64_t>(entry.Start) << 32) | entry.End;
+}
+
+// One line of a checksum list: a member's index, the offset of its image in the archive, its
+// size, its XXH64 in hex and its path
+struct ChecksumRecord
+{
+    size_t Index;
+    uint64_t Offset;
+    uint32_t Size;
+    uint64_t Hash;
+    string Path;
+};
+
+static bool LoadChecksums(const fs::path& fileName, vector<ChecksumRecord>& records)
+{
+    ifstream ifs(fileName);
+    string line;
+
+    if (!getline(ifs, line) || line != "knarc-sums 1")
+    {
+        return false;
+    }
+
+    while (getline(ifs, line))
+    {
+        istringstream iss(line);
+        ChecksumRecord record;
+
+        if (!(iss >> record.Index >> record.Offset >> record.Size >> hex >> record.Hash >> dec))
+        {
+            return false;
+        }
+
+        iss >> ws;
+        getline(iss, record.Path);
+        records.push_back(record);
+    }
+
+    return true;
+}
+
+static bool SaveChecksums(const fs::path& fileName, const vector<ChecksumRecord>& records)
+{
+    ofstream ofs(fileName);
+
+    ofs << "knarc-sums 1\n";
+
+    for (const auto& record : records)
+    {
+        ofs << record.Index << " " << record.Offset << " " << record.Size << " " << hex << record.Hash << dec << " " << record.Path << "\n";
+    }
+
+    return ofs.good();
+}
+
+// The checksum list for the members an unpack wrote, in index order
+static vector<ChecksumRecord> ExtractedChecksums(const ArchiveView& archive, const vector<ExtractionTarget>& members, const vector<uint64_t>& hashes)
+{
+    uint64_t imagesStart = archive.ArchiveHeader.ChunkSize + archive.Fat.ChunkSize + archive.Fnt.ChunkSize + sizeof(FileImages);
+    vector<ChecksumRecord> records;
+
+    for (size_t i = 0; i < members.size(); ++i)
+    {
+        const FileAllocationTableEntry& entry = archive.FatEntries[members[i].MemberId];
+
+        records.push_back({ members[i].MemberId, imagesStart + entry.Start, entry.End - entry.Start, hashes[i], members[i].Path.generic_string() });
+    }
+
+    sort(records.begin(), records.end(), [](const ChecksumRecord& a, const ChecksumRecord& b)
+        {
+            return a.Index < b.Index;
+        });
+
+    return records;
+}
+
+// Lists a freshly packed archive's members under the paths Unpack would give them, by reading
+// back the tables just written; an archive without a filename table gets names made up from
+// fileName. Duplicates were never read, so they take the hash of the image they share.
+bool Narc::WriteChecksums(const fs::path& fileName, const PackLayout& layout, vector<uint64_t>& hashes)
+{
+    ProfileScope scope(options.Profile, "checksums");
+    vector<uint8_t> metadata;
+    VectorSink sink(metadata);
+    GatherWriter out;
+    NarcReader reader;
+
+    WriteMetadata(out, layout);
+
+    if (!out.Flush(sink) || !reader.OpenTables({ metadata.data(), metadata.size() }, fileName.empty() ? fs::path("narc") : fileName))
+    {
+        error = NarcError::InvalidOutputFile;
+
+        return false;
+    }
+
+    vector<string> paths(layout.Members.size());
+
+    for (const auto& target : reader.Plan().Members)
+    {
+        paths[target.MemberId] = target.Path.generic_string();
+    }
+
+    unordered_map<uint64_t, size_t> firstCopies;
+    vector<ChecksumRecord> records;
+
+    for (size_t i = 0; i < layout.Members.size(); ++i)
+    {
+        const FileAllocationTableEntry& entry = layout.FatEntries[i];
+        auto firstCopy = firstCopies.insert({ ImageRange(entry), i }).first;
+
+        if (layout.Duplicate[i])
+        {
+            hashes[i] = hashes[firstCopy->second];
+        }
+
+        records.push_back({ i, metadata.size() + entry.Start, layout.Members[i]->Size, hashes[i], paths[i] });
+    }
+
+    if (!SaveChecksums(options.Checksums, records))
+    {
+        error = NarcError::InvalidOutputFile;
+
+        return false;
+    }
+
+    Count(options.Profile, Counter::FilesWritten);
+
+    return true;
+}
+
+// Per-member state recorded next to an archive packed with -c
+struct CacheRecord
+{
+    uint64_t Offset;
+    uint32_t Size;
+    int64_t ModifiedTime;
+    uint64_t Inode;
+    uint64_t Hash;
+    string Path;
+};
+
+struct PackCache
+{
+    uint64_t LayoutHash = 0;
+    uint64_t OutputSize = 0;
+    int64_t OutputTime = 0;
+    vector<CacheRecord> Members;
+};
+
+static bool LoadPackCache(const fs::path& cacheName, PackCache& cache)
+{
+    ifstream ifs(cacheName);
+    string line;
+
+    if (!getline(ifs, line) || line != "knarc-cache 1")
+    {
+        return false;
+    }
+
+    string tag;
+
+    if (!(ifs >> tag >> hex >> cache.LayoutHash >> dec) || tag != "layout")
+    {
+        return false;
+    }
+
+    if (!(ifs >> tag >> cache.OutputSize >> cache.OutputTime) || tag != "output")
+    {
+        return false;
+    }
+
+    CacheRecord record;
+
+    while (ifs >> record.Offset >> record.Size >> record.ModifiedTime >> record.Inode >> hex >> record.Hash >> dec)
+    {
+        // The path is the rest of the line, after one separating space
+        ifs.get();
+
+        if (!getline(ifs, record.Path))
+        {
+            return false;
+        }
+
+        cache.Members.push_back(record);
+    }
+
+    return ifs.eof();
+}
+
+static bool SavePackCache(const fs::path& cacheName, const PackCache& cache)
+{
+    fs::path temporaryName = cacheName;
+    temporaryName += ".tmp";
+
+    {
+        ofstream ofs(temporaryName);
+
+        ofs << "knarc-cache 1\n";
+        ofs << "layout " << hex << cache.LayoutHash << dec << "\n";
+        ofs << "output " << cache.OutputSize << " " << cache.OutputTime << "\n";
+
+        for (const auto& record : cache.Members)
+        {
+            ofs << record.Offset << " " << record.Size << " " << record.ModifiedTime << " " << record.Inode << " " << hex << record.Hash << dec << " " << record.Path << "\n";
+        }
+
+        if (!ofs.good())
+        {
+            return false;
+        }
+    }
+
+    error_code ec;
+    fs::rename(temporaryName, cacheName, ec);
+
+    return !ec;
+}
+
+static bool HashFile(const fs::path& path, uint64_t& hash)
+{
+    MappedFile file;
+
+    if (!file.Open(path))
+    {
+        return false;
+    }
+
+    hash = Xxh64::Hash(file.Data(), file.Size());
+
+    return true;
+}
+
+// Anything that changes the bytes before the first image changes this hash
+static uint64_t HashLayout(const PackLayout& layout, bool packNoFnt)
+{
+    Xxh64 state;
+
+    state.Update(&layout.ArchiveHeader, sizeof(Header));
+    state.Update(&layout.Fat, sizeof(FileAllocationTable));
+    state.Update(layout.FatEntries.data(), layout.FatEntries.size() * sizeof(FileAllocationTableEntry));
+    state.Update(&layout.Fnt, sizeof(FileNameTable));
+    state.Update(layout.FntEntries.data(), layout.FntEntries.size() * sizeof(FileNameTableEntry));
+
+    if (!packNoFnt)
+    {
+        for (const auto& subTable : layout.SubTables)
+        {
+            state.Update(subTable.data(), subTable.size());
+        }
+    }
+
+    state.Update(&layout.Fi, sizeof(FileImages));
+
+    return state.Digest();
+}
+
+// Repacks against the cache left next to the output by the previous run. Members whose size,
+// mtime and inode match the cache are assumed unchanged; members that were merely touched are
+// hashed to find out. Only the metadata and the images that actually changed are rewritten, and
+// when nothing changed the output is not opened at all.
+bool Narc::PackIncremental(const fs::path& fileName, const PackLayout& layout)
+{
+    ProfileScope scope(options.Profile, "incremental");
+    fs::path cacheName = fileName;
+    cacheName += ".knarccache";
+
+    uint64_t imagesStart = sizeof(Header) + layout.Fat.ChunkSize + layout.Fnt.ChunkSize + sizeof(FileImages);
+    size_t count = layout.Members.size();
+
+    PackCache previous;
+    PackCache next;
+    uint64_t outputSize = 0;
+    int64_t outputTime = 0;
+    uint64_t outputInode = 0;
+
+    // The cache only describes the output if nobody has written to it since
+    bool trusted = LoadPackCache(cacheName, previous)
+        && StatFile(fileName, outputSize, outputTime, outputInode)
+        && outputSize == previous.OutputSize && outputTime == previous.OutputTime;
+
+    next.LayoutHash = HashLayout(layout, options.PackNoFnt);
+    next.Members.resize(count);
+
+    vector<char> dirty(count, 1);
+    vector<char> hashed(count, 0);
+    bool touched = !trusted || previous.Members.size() != count;
+
+    unordered_map<string, const CacheRecord*> cached;
+
+    if (trusted)
+    {
+        for (const auto& record : previous.Members)
+        {
+            cached[record.Path] = &record;
+        }
+    }
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        const PackEntry& member = *layout.Members[i];
+        CacheRecord& record = next.Members[i];
+
+        record = { imagesStart + layout.FatEntries[i].Start, member.Size, member.ModifiedTime, member.Inode, 0, member.Path.string() };
+
+        auto it = cached.find(record.Path);
+
+        if (it == cached.end() || it->second->Offset != record.Offset || it->second->Size != record.Size)
+        {
+            touched = true;
+            continue;
+        }
+
+        const CacheRecord& old = *it->second;
+
+        if (old.ModifiedTime == record.ModifiedTime && old.Inode == record.Inode)
+        {
+            record.Hash = old.Hash;
+            hashed[i] = 1;
+            dirty[i] = 0;
+            continue;
+        }
+
+        touched = true;
+
+        if (HashFile(member.Path, record.Hash))
+        {
+            hashed[i] = 1;
+            dirty[i] = record.Hash != old.Hash;
+        }
+    }
+
+    bool metadataDirty = !trusted || previous.LayoutHash != next.LayoutHash;
+    bool imagesDirty = find(dirty.begin(), dirty.end(), 1) != dirty.end();
+
+    // The cache already holds every member's hash by the time this is called
+    auto writeChecksums = [&]()
+    {
+        if (options.Checksums.empty())
+        {
+            return true;
+        }
+
+        vector<uint64_t> hashes(count);
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            hashes[i] = next.Members[i].Hash;
+        }
+
+        return WriteChecksums(fileName, layout, hashes);
+    };
+
+    if (options.OutputHeader)
+    {
+        fs::path naixfname = fileName;
+        naixfname.replace_extension(".naix");
+
+        ifstream ifhs(naixfname, ios::binary);
+        ostringstream current;
+        current << ifhs.rdbuf();
+
+        if (!ifhs.good() || current.str() != layout.Naix)
+        {
+            ifhs.close();
+
+            ofstream ofhs(naixfname);
+
+            if (!ofhs.good())
+            {
+                error = NarcError::InvalidOutputFile;
+
+                return false;
+            }
+
+            ofhs << layout.Naix;
+        }
+    }
+
+    if (!metadataDirty && !imagesDirty && !touched)
+    {
+        return writeChecksums();
+    }
+
+    if (metadataDirty || imagesDirty)
+    {
+        vector<uint64_t> hashes;
+        bool written = trusted ? PatchArchive(fileName, layout, metadataDirty, dirty, &hashes) : WriteArchive(fileName, layout, &hashes);
+
+        if (!written)
+        {
+            // Whatever the cache says about the output no longer holds
+            error_code ec;
+            fs::remove(cacheName, ec);
+
+            return false;
+        }
+
+        // Members were hashed as they were copied, so none of them has to be read again; a
+        // duplicate has the bytes, and so the hash, of the first member sharing its image
+        unordered_map<uint64_t, size_t> firstCopies;
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            size_t original = firstCopies.insert({ ImageRange(layout.FatEntries[i]), i }).first->second;
+
+            if (hashed[i])
+            {
+                continue;
+            }
+
+            if (layout.Duplicate[i])
+            {
+                next.Members[i].Hash = next.Members[original].Hash;
+                hashed[i] = hashed[original];
+            }
+            else if (!trusted || dirty[i])
+            {
+                next.Members[i].Hash = hashes[i];
+                hashed[i] = 1;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (!hashed[i] && !HashFile(layout.Members[i]->Path, next.Members[i].Hash))
+        {
+            error = NarcError::InvalidInputFile;
+
+            return false;
+        }
+    }
+
+    if (!StatFile(fileName, next.OutputSize, next.OutputTime, outputInode) || !SavePackCache(cacheName, next))
+    {
+        error = NarcError::InvalidOutputFile;
+
+        return false;
+    }
+
+    return writeChecksums();
+}
+
+bool Narc::Pack(const fs::path& fileName, const fs::path& directory)
+{
+    // Walk the directory tree once; every phase below works from this manifest
+    PackManifest manifest = BuildPackManifest(directory);
+    PackLayout layout = BuildPackLayout(manifest, fileName);
+
+    if (options.UseCache)
+    {
+        return PackIncremental(fileName, layout);
+    }
+
+    if (options.OutputHeader)
+    {
+        fs::path naixfname = fileName;
+        naixfname.replace_extension(".naix");
+
+        ofstream ofhs(naixfname);
+
+        if (!ofhs.good())
+        {
+            error = NarcError::InvalidOutputFile;
+
+            return false;
+        }
+
+        ofhs << layout.Naix;
+
+        Count(options.Profile, Counter::FilesWritten);
+        Count(options.Profile, Counter::BytesWritten, layout.Naix.size());
+    }
+
+    vector<uint64_t> hashes;
+    bool checksums = !options.Checksums.empty();
+
+    return WriteArchive(fileName, layout, checksums ? &hashes : nullptr) && (!checksums || WriteChecksums(fileName, layout, hashes));
+}
+
+// Everything is laid out before the first byte goes out, so the sink is only ever appended to
+// and can be a pipe
+bool Narc::Pack(const fs::path& directory, ByteSink& sink)
+{
+    PackManifest manifest = BuildPackManifest(directory);
+    PackLayout layout = BuildPackLayout(manifest, fs::path());
+    vector<uint64_t> hashes;
+    bool checksums = !options.Checksums.empty();
+
+    return WriteArchive(sink, layout, checksums ? &hashes : nullptr) && (!checksums || WriteChecksums(fs::path(), layout, hashes));
+}
+
+bool Narc::Pack(const vector<MemberView>& members, ByteSink& sink)
+{
+    // A FAT entry cannot describe anything larger
+    for (const auto& member : members)
+    {
+        if (member.Data.Size > 0xFFFFFFFF)
+        {
+            error = NarcError::InvalidFileSize;
+
+            return false;
+        }
+    }
+
+    PackManifest manifest = BuildMemoryManifest(members);
+    PackLayout layout = BuildPackLayout(manifest, fs::path());
+    vector<uint64_t> hashes;
+    bool checksums = !options.Checksums.empty();
+
+    return WriteArchive(sink, layout, checksums ? &hashes : nullptr) && (!checksums || WriteChecksums(fs::path(), layout, hashes));
+}
+
+// Keeps the members selected by -m, and only the directories they need
+static bool FilterPlan(const ExtractionPlan& plan, const vector<string>& selectors, ExtractionPlan& filtered)
+{
+    vector<pair<size_t, size_t>> ranges;
+    vector<string> globs;
+
+    for (const auto& selector : selectors)
+    {
+        size_t dash = selector.find('-');
+        string first = selector.substr(0, dash);
+        string last = dash == string::npos ? first : selector.substr(dash + 1);
+        auto isNumber = [](const string& s) { return all_of(s.begin(), s.end(), [](char c) { return isdigit(static_cast<unsigned char>(c)); }); };
+
+        if (!first.empty() && isNumber(first) && isNumber(last) && (dash == string::npos || last.find('-') == string::npos))
+        {
+            ranges.push_back({ strtoull(first.c_str(), nullptr, 10), last.empty() ? SIZE_MAX : strtoull(last.c_str(), nullptr, 10) });
+
+            // A reversed range would quietly select nothing
+            if (ranges.back().first > ranges.back().second)
+            {
+                return false;
+            }
+        }
+        else
+        {
+            globs.push_back(selector);
+        }
+    }
+
+    set<fs::path> directories;
+
+    for (const auto& target : plan.Members)
+    {
+        bool selected = any_of(ranges.begin(), ranges.end(), [&](const pair<size_t, size_t>& range)
+            {
+                return target.MemberId >= range.first && target.MemberId <= range.second;
+            });
+
+        for (size_t i = 0; !selected && i < globs.size(); ++i)
+        {
+            selected = fnmatch(globs[i].c_str(), target.Path.generic_string().c_str(), FNM_PATHNAME) == 0;
+        }
+
+        if (!selected)
+        {
+            continue;
+        }
+
+        filtered.Members.push_back(target);
+
+        if (target.Path.has_parent_path())
+        {
+            directories.insert(target.Path.parent_path());
+        }
+    }
+
+    filtered.Directories.assign(directories.begin(), directories.end());
+
+    return true;
+}
+
+bool Narc::Extract(const NarcReader& reader, MemberSink& sink)
+{
+    ProfileScope scope(options.Profile, "extract");
+    ExtractionPlan plan;
+
+    if (options.Members.empty())
+    {
+        plan = reader.Plan();
+    }
+    else if (!FilterPlan(reader.Plan(), options.Members, plan))
+    {
+        error = NarcError::InvalidMember;
+
+        return false;
+    }
+
+    for (const auto& path : plan.Directories)
+    {
+        if (!sink.Directory(path))
+        {
+            error = NarcError::InvalidOutputFile;
+
+            return false;
+        }
+    }
+
+    Count(options.Profile, Counter::DirectoriesCreated, plan.Directories.size());
+
+    // Members whose FAT entries give the same range are written once, and the others are made
+    // from that first copy once it is complete
+    const vector<FileAllocationTableEntry>& fatEntries = reader.Archive().FatEntries;
+    unordered_map<uint64_t, size_t> firstCopies;
+    vector<size_t> original(plan.Members.size());
+
+    for (size_t i = 0; i < plan.Members.size(); ++i)
+    {
+        const FileAllocationTableEntry& entry = fatEntries[plan.Members[i].MemberId];
+
+        original[i] = entry.End > entry.Start ? firstCopies.insert({ ImageRange(entry), i }).first->second : i;
+    }
+
+    unsigned int workers = sink.Concurrent() ? options.Jobs : 1;
+    bool checksums = !options.Checksums.empty();
+    vector<uint64_t> hashes(checksums ? plan.Members.size() : 0);
+
+    // Each first copy is hashed by the worker writing it, while its bytes are still at hand
+    bool written = ParallelFor(plan.Members.size(), workers, [&](size_t i)
+        {
+            if (original[i] != i)
+            {
+                return true;
+            }
+
+            ByteSpan bytes = reader.Archive().Member(plan.Members[i].MemberId);
+
+            if (checksums)
+            {
+                hashes[i] = Xxh64::Hash(bytes.Data, bytes.Size);
+            }
+
+            return sink.Member(plan.Members[i].Path, bytes);
+        });
+
+    written = written && ParallelFor(plan.Members.size(), workers, [&](size_t i)
+        {
+            return original[i] == i || sink.Duplicate(plan.Members[i].Path, plan.Members[original[i]].Path, reader.Archive().Member(plan.Members[i].MemberId));
+        });
+
+    if (written && checksums)
+    {
+        for (size_t i = 0; i < plan.Members.size(); ++i)
+        {
+            hashes[i] = hashes[original[i]];
+        }
+
+        written = SaveChecksums(options.Checksums, ExtractedChecksums(reader.Archive(), plan.Members, hashes));
+    }
+
+    if (!written) { error = NarcError::InvalidOutputFile; }
+
+    if (written && options.Profile)
+    {
+        for (const auto& target : plan.Members)
+        {
+            const FileAllocationTableEntry& entry = fatEntries[target.MemberId];
+
+            options.Profile->Add(Counter::FilesWritten, 1);
+            options.Profile->Add(Counter::BytesWritten, entry.End - entry.Start);
+        }
+    }
+
+    return error == NarcError::None ? true : false;
+}
+
+// Maps and parses the archive and plans its extraction
+bool Narc::OpenArchive(NarcReader& reader, const fs::path& fileName)
+{
+    ProfileScope scope(options.Profile, "open");
+
+    if (!reader.Open(fileName))
+    {
+        error = reader.GetError();
+
+        return false;
+    }
+
+    Count(options.Profile, Counter::FilesRead);
+    Count(options.Profile, Counter::BytesRead, reader.Archive().ArchiveHeader.FileSize);
+
+    return true;
+}
+
+bool Narc::Unpack(const fs::path& fileName, const fs::path& directory)
+{
+    NarcReader reader;
+
+    if (!OpenArchive(reader, fileName))
+    {
+        return false;
+    }
+
+    fs::create_directory(directory);
+
+    DirectorySink sink(directory, options.HardLinks);
+
+    return Extract(reader, sink);
+}
+
+bool Narc::Unpack(const fs::path& fileName, MemberSink& sink)
+{
+    NarcReader reader;
+
+    if (!OpenArchive(reader, fileName))
+    {
+        return false;
+    }
+
+    return Extract(reader, sink);
+}
+
+bool Narc::Unpack(ByteSpan archive, MemberSink& sink)
+{
+    NarcReader reader;
+
+    if (!reader.Open(archive, "narc"))
+    {
+        error = reader.GetError();
+
+        return false;
+    }
+
+    return Extract(reader, sink);
+}
+
+// Appends exactly size bytes from the stream, growing the buffer as data actually arrives
+static bool ReadExact(istream& is, vector<uint8_t>& buffer, size_t size)
+{
+    while (size > 0)
+    {
+        size_t chunk = min(size, CopyBufferSize);
+        size_t used = buffer.size();
+
+        buffer.resize(used + chunk);
+
+        if (!is.read(reinterpret_cast<char*>(buffer.data() + used), chunk))
+        {
+            return false;
+        }
+
+        size -= chunk;
+    }
+
+    return true;
+}
+
+// Reads one chunk whose size is in the 32-bit word after its ID
+static bool ReadChunk(istream& is, vector<uint8_t>& buffer, size_t headerSize)
+{
+    size_t start = buffer.size();
+
+    if (!ReadExact(is, buffer, headerSize))
+    {
+        return false;
+    }
+
+    uint32_t chunkSize;
+    memcpy(&chunkSize, buffer.data() + start + sizeof(uint32_t), sizeof(uint32_t));
+
+    return chunkSize >= headerSize && ReadExact(is, buffer, chunkSize - headerSize);
+}
+
+bool Narc::Unpack(istream& is, MemberSink& sink)
+{
+    ProfileScope scope(options.Profile, "extract");
+    vector<uint8_t> tables;
+
+    // Not even a header: an empty or truncated stream rather than a damaged archive
+    if (!ReadExact(is, tables, sizeof(Header)))
+    {
+        error = NarcError::InvalidInputFile;
+
+        return false;
+    }
+
+    // FAT and FNT in full, then just the GMIF chunk header
+    if (!ReadChunk(is, tables, sizeof(FileAllocationTable))
+        || !ReadChunk(is, tables, sizeof(FileNameTable))
+        || !ReadExact(is, tables, sizeof(FileImages)))
+    {
+        error = NarcError::InvalidChunkSize;
+
+        return false;
+    }
+
+    NarcReader reader;
+
+    if (!reader.OpenTables({ tables.data(), tables.size() }, "narc"))
+    {
+        error = reader.GetError();
+
+        return false;
+    }
+
+    ExtractionPlan plan;
+
+    if (options.Members.empty())
+    {
+        plan = reader.Plan();
+    }
+    else if (!FilterPlan(reader.Plan(), options.Members, plan))
+    {
+        error = NarcError::InvalidMember;
+
+        return false;
+    }
+    const vector<FileAllocationTableEntry>& fatEntries = reader.Archive().FatEntries;
+
+    for (const auto& path : plan.Directories)
+    {
+        if (!sink.Directory(path))
+        {
+            error = NarcError::InvalidOutputFile;
+
+            return false;
+        }
+    }
+
+    // Members go out in the order their images come in
+    stable_sort(plan.Members.begin(), plan.Members.end(), [&](const ExtractionTarget& a, const ExtractionTarget& b)
+        {
+            return fatEntries[a.MemberId].Start < fatEntries[b.MemberId].Start;
+        });
+
+    // window holds the images from windowStart up to position, which is how far into the GMIF
+    // chunk the stream has been read; images can overlap, so it may cover more than one member
+    vector<uint8_t> window;
+    uint64_t windowStart = 0;
+    uint64_t position = 0;
+
+    auto skip = [&](uint64_t size)
+    {
+        vector<char> discard(min<uint64_t>(size, CopyBufferSize));
+
+        for (uint64_t done = 0; done < size; )
+        {
+            uint64_t chunk = min<uint64_t>(discard.size(), size - done);
+
+            if (!is.read(discard.data(), chunk))
+            {
+                return false;
+            }
+
+            done += chunk;
+        }
+
+        return true;
+    };
+
+    // Paths already written, by image range, among the members starting where this one does
+    unordered_map<uint64_t, fs::path> firstCopies;
+    vector<uint64_t> hashes;
+
+    for (const auto& target : plan.Members)
+    {
+        const FileAllocationTableEntry& entry = fatEntries[target.MemberId];
+
+        if (!firstCopies.empty() && entry.Start != (firstCopies.begin()->first >> 32))
+        {
+            firstCopies.clear();
+        }
+
+        if (entry.Start >= position)
+        {
+            window.clear();
+
+            if (!skip(entry.Start - position))
+            {
+                error = NarcError::InvalidChunkSize;
+
+                return false;
+            }
+
+            windowStart = position = entry.Start;
+        }
+        else if (entry.Start > windowStart)
+        {
+            window.erase(window.begin(), window.begin() + (entry.Start - windowStart));
+            windowStart = entry.Start;
+        }
+
+        if (entry.End > position)
+        {
+            if (!ReadExact(is, window, entry.End - position))
+            {
+                error = NarcError::InvalidChunkSize;
+
+                return false;
+            }
+
+            position = entry.End;
+        }
+
+        ByteSpan bytes = { window.data(), entry.End - entry.Start };
+        auto firstCopy = firstCopies.find(ImageRange(entry));
+        bool written = firstCopy != firstCopies.end() ? sink.Duplicate(target.Path, firstCopy->second, bytes) : sink.Member(target.Path, bytes);
+
+        if (entry.End > entry.Start && firstCopy == firstCopies.end())
+        {
+            firstCopies.insert({ ImageRange(entry), target.Path });
+        }
+
+        if (!written)
+        {
+            error = NarcError::InvalidOutputFile;
+
+            return false;
+        }
+
+        if (!options.Checksums.empty())
+        {
+            hashes.push_back(Xxh64::Hash(bytes.Data, bytes.Size));
+        }
+
+        Count(options.Profile, Counter::FilesWritten);
+        Count(options.Profile, Counter::BytesWritten, bytes.Size);
+    }
+
+    // Drain the rest of the chunk rather than leave the writer on the other end of a pipe hanging
+    if (!skip(reader.Archive().Images.Size - position))
+    {
+        error = NarcError::InvalidChunkSize;
+
+        return false;
+    }
+
+    if (!options.Checksums.empty() && !SaveChecksums(options.Checksums, ExtractedChecksums(reader.Archive(), plan.Members, hashes)))
+    {
+        error = NarcError::InvalidOutputFile;
+
+        return false;
+    }
+
+    Count(options.Profile, Counter::DirectoriesCreated, plan.Directories.size());
+    Count(options.Profile, Counter::BytesRead, tables.size() + reader.Archive().Images.Size);
+
+    return error == NarcError::None ? true : false;
+}
+
+// Moves size bytes of the file from one offset to another, back to front when moving towards the end
+static bool MoveRange(fstream& fs, uint64_t from, uint64_t to, uint64_t size)
+{
+    vector<char> buffer(CopyBufferSize);
+
+    for (uint64_t done = 0; done < size; )
+    {
+        uint64_t chunk = min<uint64_t>(buffer.size(), size - done);
+        uint64_t offset = to > from ? size - done - chunk : done;
+
+        fs.seekg(from + offset);
+        fs.read(buffer.data(), chunk);
+        fs.seekp(to + offset);
+        fs.write(buffer.data(), chunk);
+
+        if (!fs.good())
+        {
+            return false;
+        }
+
+        done += chunk;
+    }
+
+    return true;
+}
+
+// Replaces one member, named by index or by its path in the FNT. The image is patched where it
+// stands if the new data fits in its slot, padding included; otherwise only the images after it
+// are shifted and their FAT entries fixed up. A slot that another FAT entry shares is left alone
+// and the new image goes at the end of the GMIF chunk instead.
+bool Narc::Replace(const fs::path& fileName, const string& member, const fs::path& source)
+{
+    ProfileScope scope(options.Profile, "replace");
+    ArchiveView archive;
+    uint64_t fileSize;
+    size_t id;
+
+    {
+        NarcReader reader;
+
+        if (!reader.Open(fileName))
+        {
+            error = reader.GetError();
+
+            return false;
+        }
+
+        // All digits is an index; a leading "./" or "/" marks a path, for names like "0001"
+        bool forcedPath = member.compare(0, 2, "./") == 0 || member.compare(0, 1, "/") == 0;
+        string path = forcedPath ? member.substr(member[0] == '/' ? 1 : 2) : member;
+
+        if (!forcedPath && !member.empty() && all_of(member.begin(), member.end(), [](char c) { return isdigit(static_cast<unsigned char>(c)); }))
+        {
+            id = strtoul(member.c_str(), nullptr, 10);
+        }
+        else if (!reader.Find(path, id))
+        {
+            id = reader.Count();
+        }
+
+        // Only the parsed tables are used from here on, not the mapping
+        archive = reader.Archive();
+        fileSize = archive.ArchiveHeader.ChunkSize + archive.Fat.ChunkSize + archive.Fnt.ChunkSize + archive.Fi.ChunkSize;
+    }
+
+    if (id >= archive.FatEntries.size())
+    {
+        error = NarcError::InvalidMember;
+
+        return false;
+    }
+
+    MappedFile input;
+
+    if (!input.Open(source) || input.Size() > 0xFFFFFFFF)
+    {
+        error = NarcError::InvalidInputFile;
+
+        return false;
+    }
+
+    uint64_t imagesStart = archive.ArchiveHeader.ChunkSize + archive.Fat.ChunkSize + archive.Fnt.ChunkSize + sizeof(FileImages);
+    uint64_t imagesSize = archive.Images.Size;
+    uint32_t size = static_cast<uint32_t>(input.Size());
+
+    vector<FileAllocationTableEntry>& fatEntries = archive.FatEntries;
+    uint32_t start = fatEntries[id].Start;
+    uint32_t slotEnd = static_cast<uint32_t>(min<uint64_t>((fatEntries[id].End + 3) & ~3u, imagesSize));
+    bool shared = false;
+
+    for (size_t i = 0; i < fatEntries.size(); ++i)
+    {
+        if (i != id && fatEntries[i].Start < fatEntries[id].End && fatEntries[i].End > start)
+        {
+            shared = true;
+        }
+    }
+
+    if (shared)
+    {
+        // Treat the end of the chunk as an empty slot with nothing after it
+        start = static_cast<uint32_t>(size > 0 ? (imagesSize + 3) & ~3ull : imagesSize);
+        slotEnd = start;
+    }
+
+    // Where the images after this slot, and anything following the GMIF chunk, begin
+    uint32_t tail = static_cast<uint32_t>(min<uint64_t>(slotEnd, imagesSize));
+
+    uint32_t newSlotEnd = (start + size + 3) & ~3u;
+    int64_t delta = 0;
+
+    fstream fs(fileName, ios::binary | ios::in | ios::out);
+
+    if (!fs.good())
+    {
+        error = NarcError::InvalidOutputFile;
+
+        return false;
+    }
+
+    if (size > slotEnd - start)
+    {
+        delta = static_cast<int64_t>(newSlotEnd) - tail;
+
+        uint64_t tailStart = imagesStart + tail;
+        uint64_t tailSize = fileSize > tailStart ? fileSize - tailStart : 0;
+
+        if (!MoveRange(fs, tailStart, tailStart + delta, tailSize))
+        {
+            error = NarcError::InvalidOutputFile;
+
+            return false;
+        }
+
+        for (size_t i = 0; i < fatEntries.size(); ++i)
+        {
+            if (i != id && fatEntries[i].Start >= slotEnd)
+            {
+                fatEntries[i].Start += static_cast<uint32_t>(delta);
+                fatEntries[i].End += static_cast<uint32_t>(delta);
+            }
+        }
+
+        archive.Fi.ChunkSize += static_cast<uint32_t>(delta);
+        archive.ArchiveHeader.FileSize += static_cast<uint32_t>(delta);
+    }
+    else
+    {
+        // Whatever the old image left past the new one becomes padding
+        newSlotEnd = slotEnd;
+    }
+
+    fatEntries[id].Start = start;
+    fatEntries[id].End = start + size;
+
+    // A slot moved to the end of an unaligned chunk starts after some padding of its own
+    fs.seekp(imagesStart + tail);
+
+    for (uint32_t i = tail; i < start; ++i)
+    {
+        fs.put(static_cast<char>(0xFF));
+    }
+
+    fs.seekp(imagesStart + start);
+    fs.write(reinterpret_cast<const char*>(input.Data()), size);
+
+    for (uint32_t i = start + size; i < newSlotEnd; ++i)
+    {
+        fs.put(static_cast<char>(0xFF));
+    }
+
+    fs.seekp(0);
+    fs.write(reinterpret_cast<char*>(&archive.ArchiveHeader), sizeof(Header));
+    fs.seekp(archive.ArchiveHeader.ChunkSize + sizeof(FileAllocationTable));
+    fs.write(reinterpret_cast<char*>(fatEntries.data()), fatEntries.size() * sizeof(FileAllocationTableEntry));
+    fs.seekp(imagesStart - sizeof(FileImages));
+    fs.write(reinterpret_cast<char*>(&archive.Fi), sizeof(FileImages));
+    fs.close();
+
+    if (!fs.good())
+    {
+        error = NarcError::InvalidOutputFile;
+
+        return false;
+    }
+
+    return error == NarcError::None ? true : false;
+}
+
+bool Narc::Verify(const fs::path& fileName)
+{
+    ProfileScope scope(options.Profile, "verify");
+    NarcReader reader;
+
+    if (!OpenArchive(reader, fileName))
+    {
+        return false;
+    }
+
+    if (!reader.Verify())
+    {
+        error = reader.GetError();
+
+        return false;
+    }
+
+    if (options.Checksums.empty())
+    {
+        return true;
+    }
+
+    vector<ChecksumRecord> records;
+
+    if (!LoadChecksums(options.Checksums, records))
+    {
+        error = NarcError::InvalidInputFile;
+
+        return false;
+    }
+
+    const ArchiveView& archive = reader.Archive();
+    uint64_t imagesStart = archive.ArchiveHeader.ChunkSize + archive.Fat.ChunkSize + archive.Fnt.ChunkSize + sizeof(FileImages);
+    vector<char> listed(reader.Count(), 0);
+
+    // Every member is listed exactly once, where the archive has it
+    bool matched = records.size() == reader.Count();
+
+    for (size_t i = 0; matched && i < records.size(); ++i)
+    {
+        const ChecksumRecord& record = records[i];
+
+        matched = record.Index < listed.size() && !listed[record.Index]
+            && record.Offset == imagesStart + archive.FatEntries[record.Index].Start
+            && record.Size == archive.FatEntries[record.Index].End - archive.FatEntries[record.Index].Start;
+
+        if (matched)
+        {
+            listed[record.Index] = 1;
+        }
+        else if (options.Debug)
+        {
+            DebugLine("member ", record.Index, " is not where the checksum list has it");
+        }
+    }
+
+    matched = matched && ParallelFor(records.size(), options.Jobs, [&](size_t i)
+        {
+            ByteSpan bytes = reader.Archive().Member(records[i].Index);
+
+            if (Xxh64::Hash(bytes.Data, bytes.Size) == records[i].Hash)
+            {
+                return true;
+            }
+
+            if (options.Debug)
+            {
+                DebugLine("member ", records[i].Index, " ", records[i].Path, " does not match its checksum");
+            }
+
+            return false;
+        });
+
+    if (!matched)
+    {
+        error = NarcError::ChecksumMismatch;
+
+        return false;
+    }
+
+    return true;
 }
@@ -5,6 +5,9 @@
 #include <string>
 #include <vector>
 
+#include "MappedFile.h"
+#include "Sinks.h"
+
 #if (__cplusplus < 201703L)
 #include <experimental/filesystem>
 namespace fs = std::experimental::filesystem;
@@ -24,10 +27,16 @@ enum class NarcError
     InvalidChunkCount,
     InvalidFileAllocationTableId,
     InvalidFileAllocationTableReserved,
+    InvalidFileAllocationTableEntry,
     InvalidFileNameTableId,
     InvalidFileNameTableEntryId,
     InvalidFileImagesId,
-    InvalidOutputFile
+    InvalidChunkSize,
+    InvalidOutputFile,
+    InvalidMember,
+    InvalidFileSize,
+    ChecksumMismatch,
+    UnnamedMember
 };
 
 struct Header
@@ -73,22 +82,155 @@ struct FileImages
     uint32_t ChunkSize;
 };
 
+// An archive parsed in place; the spans point into the archive's bytes
+struct ArchiveView
+{
+    Header ArchiveHeader;
+    FileAllocationTable Fat;
+    std::vector<FileAllocationTableEntry> FatEntries;
+    FileNameTable Fnt;
+    std::vector<FileNameTableEntry> FntEntries;
+    ByteSpan FntData;
+    FileImages Fi;
+    ByteSpan Images;
+
+    ByteSpan Member(size_t id) const;
+};
+
+struct ExtractionTarget
+{
+    size_t MemberId;
+    fs::path Path;
+};
+
+// Everything Unpack creates, relative to the output directory
+struct ExtractionPlan
+{
+    std::vector<fs::path> Directories;
+    std::vector<ExtractionTarget> Members;
+};
+
+struct PackEntry
+{
+    fs::path Path;
+    bool IsDirectory;
+    bool Included;
+    uint16_t ParentId;
+    uint32_t Size;
+    int64_t ModifiedTime;
+    uint64_t Inode;
+
+    // Members packed from memory carry their bytes instead of a file to read them from
+    bool InMemory;
+    ByteSpan Data;
+};
+
+struct PackManifest
+{
+    std::vector<PackEntry> Entries;
+    std::vector<fs::path> Directories;
+};
+
+// Everything Pack derives from the manifest before it writes anything
+struct PackLayout
+{
+    Header ArchiveHeader;
+    FileAllocationTable Fat;
+    std::vector<FileAllocationTableEntry> FatEntries;
+    FileNameTable Fnt;
+    std::vector<FileNameTableEntry> FntEntries;
+    std::vector<std::string> SubTables;
+    FileImages Fi;
+    std::vector<const PackEntry*> Members;
+
+    // Set for members whose FAT entry points at an earlier member's image instead of their own
+    std::vector<char> Duplicate;
+    std::string Naix;
+};
+
+class Profiler;
+
+struct NarcOptions
+{
+    bool Debug = false;
+    bool PackNoFnt = true;
+    bool OutputHeader = false;
+    unsigned int Jobs = 1;
+    bool UseCache = false;
+    bool Deduplicate = false;
+    bool HardLinks = false;
+
+    // A checksum list that Pack and Unpack write for the members they copy, and that Verify
+    // checks every member against
+    std::string Checksums;
+
+    // Where --stats and --trace collect timings and counters; may be shared between Narcs
+    Profiler* Profile = nullptr;
+
+    // Unpack only the members matching one of these: an index, an index range "N-M" or "N-", or
+    // a glob matched against the member's path, whose wildcards do not match '/'. Empty means
+    // every member; a reversed range is an InvalidMember error.
+    std::vector<std::string> Members;
+};
+
+class GatherWriter;
+class NarcReader;
+
+// A Narc holds nothing but its options and the error from its last call, and works only on the
+// paths it is given, never the working directory. Separate instances can pack and unpack on as
+// many threads at once as needed; a single instance should be used by one thread at a time.
 class Narc
 {
 public:
+    Narc() = default;
+    explicit Narc(const NarcOptions& options);
+
     NarcError GetError() const;
 
     bool Pack(const fs::path& fileName, const fs::path& directory);
     bool Unpack(const fs::path& fileName, const fs::path& directory);
 
+    // The same, without touching the filesystem: members come from and go to memory, and archives
+    // go to any sink
+    bool Pack(const fs::path& directory, ByteSink& sink);
+    // Without a filename table, members keep their order; with one, each directory's files come
+    // first, then its subdirectories, depth first. Members must be smaller than 4 GiB.
+    bool Pack(const std::vector<MemberView>& members, ByteSink& sink);
+    bool Unpack(const fs::path& fileName, MemberSink& sink);
+    bool Unpack(ByteSpan archive, MemberSink& sink);
+    // Reads the archive front to back exactly once, so it can come from a pipe. Only the tables
+    // and the member currently being written are held in memory. Like the in-memory Unpack, it
+    // names members of an archive without a filename table narc_00000000.bin and so on.
+    bool Unpack(std::istream& is, MemberSink& sink);
+    // member is an index if it is all digits, and otherwise a path in the filename table; a
+    // leading "./" or "/" makes it a path regardless
+    bool Replace(const fs::path& fileName, const std::string& member, const fs::path& source);
+    // Checks an archive's structure without writing anything, then, given a checksum list, every
+    // member's bytes on options.Jobs threads
+    bool Verify(const fs::path& fileName);
+
 private:
+    NarcOptions options;
     NarcError error = NarcError::None;
 
-    void AlignDword(std::ofstream& ofs, uint8_t paddingChar);
-
-    bool Cleanup(std::ifstream& ifs, const NarcError& e);
+    bool Cleanup(MappedFile& file, const NarcError& e);
     bool Cleanup(std::ofstream& ofs, const NarcError& e);
 
+    PackManifest BuildPackManifest(const fs::path& directory) const;
+    PackManifest BuildMemoryManifest(const std::vector<MemberView>& members) const;
+    PackLayout BuildPackLayout(const PackManifest& manifest, const fs::path& fileName) const;
+
+    void WriteMetadata(GatherWriter& out, const PackLayout& layout);
+    // With hashes, also hashes every member that is not a duplicate as it is copied
+    bool WriteArchive(const fs::path& fileName, const PackLayout& layout, std::vector<uint64_t>* hashes = nullptr);
+    bool WriteArchive(ByteSink& sink, const PackLayout& layout, std::vector<uint64_t>* hashes = nullptr);
+    bool WriteChecksums(const fs::path& fileName, const PackLayout& layout, std::vector<uint64_t>& hashes);
+    bool PatchArchive(const fs::path& fileName, const PackLayout& layout, bool metadataDirty, const std::vector<char>& dirty, std::vector<uint64_t>* hashes = nullptr);
+    bool PackIncremental(const fs::path& fileName, const PackLayout& layout);
+
+    bool OpenArchive(NarcReader& reader, const fs::path& fileName);
+    bool Extract(const NarcReader& reader, MemberSink& sink);
+
     std::vector<fs::directory_entry> KnarcOrderDirectoryIterator(const fs::path& path, bool recursive) const;
     std::vector<fs::directory_entry> OrderedDirectoryIterator(const fs::path& path, bool recursive) const;
 };
@@ -0,0 +1,508 @@
+#include "NarcReader.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+ByteSpan ArchiveView::Member(size_t id) const
+{
+    return { Images.Data + FatEntries[id].Start, FatEntries[id].End - FatEntries[id].Start };
+}
+
+// Validates the header and the FAT, FNT and GMIF chunks in place. On success, archive refers
+// into bytes, which has to outlive it. Without images, bytes only has to run up to the end of the
+// GMIF chunk header and archive.Images has no data.
+static NarcError ParseArchive(ByteSpan bytes, ArchiveView& archive, bool withImages)
+{
+    if (bytes.Size < sizeof(Header)) { return NarcError::InvalidChunkSize; }
+
+    memcpy(&archive.ArchiveHeader, bytes.Data, sizeof(Header));
+
+    const Header& header = archive.ArchiveHeader;
+
+    if (header.Id != 0x4352414E) { return NarcError::InvalidHeaderId; }
+    if (header.ByteOrderMark != 0xFFFE) { return NarcError::InvalidByteOrderMark; }
+    if ((header.Version != 0x0100) && (header.Version != 0x0000)) { return NarcError::InvalidVersion; }
+    if (header.ChunkSize != 0x10) { return NarcError::InvalidHeaderSize; }
+    if (header.ChunkCount != 0x3) { return NarcError::InvalidChunkCount; }
+
+    size_t offset = header.ChunkSize;
+
+    if (bytes.Size - offset < sizeof(FileAllocationTable)) { return NarcError::InvalidChunkSize; }
+
+    memcpy(&archive.Fat, bytes.Data + offset, sizeof(FileAllocationTable));
+
+    const FileAllocationTable& fat = archive.Fat;
+
+    if (fat.Id != 0x46415442) { return NarcError::InvalidFileAllocationTableId; }
+    if (fat.Reserved != 0x0) { return NarcError::InvalidFileAllocationTableReserved; }
+    if ((fat.ChunkSize < sizeof(FileAllocationTable) + fat.FileCount * sizeof(FileAllocationTableEntry)) || (bytes.Size - offset < fat.ChunkSize)) { return NarcError::InvalidChunkSize; }
+
+    archive.FatEntries.resize(fat.FileCount);
+    memcpy(archive.FatEntries.data(), bytes.Data + offset + sizeof(FileAllocationTable), fat.FileCount * sizeof(FileAllocationTableEntry));
+
+    offset += fat.ChunkSize;
+
+    if (bytes.Size - offset < sizeof(FileNameTable)) { return NarcError::InvalidChunkSize; }
+
+    memcpy(&archive.Fnt, bytes.Data + offset, sizeof(FileNameTable));
+
+    const FileNameTable& fnt = archive.Fnt;
+
+    if (fnt.Id != 0x464E5442) { return NarcError::InvalidFileNameTableId; }
+    if ((fnt.ChunkSize < sizeof(FileNameTable) + sizeof(FileNameTableEntry)) || (bytes.Size - offset < fnt.ChunkSize)) { return NarcError::InvalidChunkSize; }
+
+    archive.FntData = { bytes.Data + offset + sizeof(FileNameTable), fnt.ChunkSize - sizeof(FileNameTable) };
+
+    // The directory table runs up to where the first subtable starts
+    uint32_t firstOffset;
+    memcpy(&firstOffset, archive.FntData.Data, sizeof(uint32_t));
+
+    size_t directoryCount = max<size_t>(1, (firstOffset + sizeof(FileNameTableEntry) - 1) / sizeof(FileNameTableEntry));
+
+    if (directoryCount * sizeof(FileNameTableEntry) > archive.FntData.Size) { return NarcError::InvalidChunkSize; }
+
+    archive.FntEntries.resize(directoryCount);
+    memcpy(archive.FntEntries.data(), archive.FntData.Data, directoryCount * sizeof(FileNameTableEntry));
+
+    for (const auto& entry : archive.FntEntries)
+    {
+        if (entry.Offset > archive.FntData.Size) { return NarcError::InvalidFileNameTableEntryId; }
+    }
+
+    offset += fnt.ChunkSize;
+
+    if (bytes.Size - offset < sizeof(FileImages)) { return NarcError::InvalidChunkSize; }
+
+    memcpy(&archive.Fi, bytes.Data + offset, sizeof(FileImages));
+
+    if (archive.Fi.Id != 0x46494D47) { return NarcError::InvalidFileImagesId; }
+    if ((archive.Fi.ChunkSize < sizeof(FileImages)) || (withImages && bytes.Size - offset < archive.Fi.ChunkSize)) { return NarcError::InvalidChunkSize; }
+
+    archive.Images = { withImages ? bytes.Data + offset + sizeof(FileImages) : nullptr, archive.Fi.ChunkSize - sizeof(FileImages) };
+
+    for (const auto& entry : archive.FatEntries)
+    {
+        if ((entry.Start > entry.End) || (entry.End > archive.Images.Size)) { return NarcError::InvalidFileAllocationTableEntry; }
+    }
+
+    return NarcError::None;
+}
+
+// A name in the FNT chunk, left where it is
+struct NameRef
+{
+    uint32_t Offset = 0;
+    uint8_t Length = 0;
+};
+
+// Decodes the FNT in a single pass into names that point into the chunk, then works out every
+// directory and output path up front, so the members can be written in any order
+// A name has to stay one path component under its parent when unpacked: not empty, ".", "..",
+// and free of '/' and NUL, which would also let it escape the output directory
+static bool IsPlainName(const uint8_t* name, size_t length)
+{
+    if (length == 0 || (name[0] == '.' && (length == 1 || (length == 2 && name[1] == '.'))))
+    {
+        return false;
+    }
+
+    return find_if(name, name + length, [](uint8_t c) { return c == '/' || c == '\0'; }) == name + length;
+}
+
+static NarcError BuildExtractionPlan(const ArchiveView& archive, const fs::path& fileName, ExtractionPlan& plan)
+{
+    const vector<FileNameTableEntry>& fntEntries = archive.FntEntries;
+    const uint8_t* fntData = archive.FntData.Data;
+    size_t fntSize = archive.FntData.Size;
+
+    vector<NameRef> memberNames(archive.Fat.FileCount);
+    vector<NameRef> directoryNames(fntEntries.size());
+
+    // Every file entry in FNT order, as (directory, member)
+    vector<pair<uint16_t, uint16_t>> listed;
+
+    for (size_t i = 0; i < fntEntries.size(); ++i)
+    {
+        size_t offset = fntEntries[i].Offset;
+        uint16_t fileId = 0x0000;
+
+        // Running into the end of the chunk ends the subtable like a terminator would
+        while (offset < fntSize)
+        {
+            uint8_t length = fntData[offset++];
+
+            if (length == 0x00)
+            {
+                break;
+            }
+            else if (length <= 0x7F)
+            {
+                size_t id = static_cast<size_t>(fntEntries[i].FirstFileId) + fileId;
+
+                if ((id >= archive.Fat.FileCount) || (fntSize - offset < length)) { return NarcError::InvalidFileNameTableEntryId; }
+                if (!IsPlainName(fntData + offset, length)) { return NarcError::InvalidFileNameTableEntryId; }
+
+                memberNames[id] = { static_cast<uint32_t>(offset), length };
+                listed.push_back({ static_cast<uint16_t>(i), static_cast<uint16_t>(id) });
+                offset += length;
+
+                ++fileId;
+            }
+            else if (length == 0x80)
+            {
+                // Reserved
+            }
+            else
+            {
+                length -= 0x80;
+
+                if (fntSize - offset < static_cast<size_t>(length) + sizeof(uint16_t)) { return NarcError::InvalidFileNameTableEntryId; }
+                if (!IsPlainName(fntData + offset, length)) { return NarcError::InvalidFileNameTableEntryId; }
+
+                uint16_t directoryId;
+                memcpy(&directoryId, fntData + offset + length, sizeof(uint16_t));
+
+                if (directoryId == 0xFFFF) { return NarcError::InvalidFileNameTableEntryId; }
+
+                // Directory and file IDs share one namespace; an ID below 0xF000 renames a file
+                if (directoryId >= 0xF000 && static_cast<size_t>(directoryId - 0xF000) < directoryNames.size())
+                {
+                    directoryNames[directoryId - 0xF000] = { static_cast<uint32_t>(offset), length };
+                }
+                else if (directoryId < memberNames.size())
+                {
+                    memberNames[directoryId] = { static_cast<uint32_t>(offset), length };
+                }
+
+                offset += length + sizeof(uint16_t);
+            }
+        }
+    }
+
+    auto name = [&](const NameRef& ref)
+    {
+        return string(reinterpret_cast<const char*>(fntData + ref.Offset), ref.Length);
+    };
+
+    if (archive.Fnt.ChunkSize == 0x10)
+    {
+        for (uint16_t i = 0; i < archive.Fat.FileCount; ++i)
+        {
+            ostringstream oss;
+            oss << fileName.stem().string() << "_" << setfill('0') << setw(8) << i << ".bin";
+
+            plan.Members.push_back({ i, oss.str() });
+        }
+
+        return NarcError::None;
+    }
+
+    // A directory's path is its parent's plus its own name, so each one is built exactly once.
+    // Directories are resolved by climbing to the nearest one already known and filling the
+    // paths back in on the way down; a parent chain that loops or leaves the table is an error.
+    vector<fs::path> directoryPaths(fntEntries.size());
+    vector<uint8_t> resolved(fntEntries.size(), 0);
+    vector<size_t> pending;
+
+    for (size_t i = 0; i < fntEntries.size(); ++i)
+    {
+        size_t d = i;
+        bool atRoot = false;
+
+        while (resolved[d] == 0)
+        {
+            if (0xF000 + d >= 0xFFFF) { return NarcError::InvalidFileNameTableEntryId; }
+
+            resolved[d] = 1;
+            pending.push_back(d);
+
+            if (fntEntries[d].Utility <= 0xF000)
+            {
+                atRoot = true;
+                break;
+            }
+
+            d = fntEntries[d].Utility - 0xF000;
+
+            if (d >= fntEntries.size()) { return NarcError::InvalidFileNameTableEntryId; }
+        }
+
+        if (!atRoot && resolved[d] == 1) { return NarcError::InvalidFileNameTableEntryId; }
+
+        for (auto it = pending.rbegin(); it != pending.rend(); ++it)
+        {
+            uint16_t parent = fntEntries[*it].Utility;
+
+            directoryPaths[*it] = (parent > 0xF000 ? directoryPaths[parent - 0xF000] : fs::path()) / name(directoryNames[*it]);
+            resolved[*it] = 2;
+        }
+
+        pending.clear();
+    }
+
+    // The root, and anything claiming a parent below 0xF000, extracts to the output directory itself
+    for (size_t i = 0; i < fntEntries.size(); ++i)
+    {
+        if (fntEntries[i].Utility < 0xF000)
+        {
+            directoryPaths[i].clear();
+        }
+        else if (!directoryPaths[i].empty())
+        {
+            plan.Directories.push_back(directoryPaths[i]);
+        }
+    }
+
+    // When the same path comes up twice, only the member written last would survive
+    unordered_map<string, size_t> planned;
+
+    for (const auto& entry : listed)
+    {
+        fs::path memberPath = directoryPaths[entry.first] / name(memberNames[entry.second]);
+        auto it = planned.find(memberPath.string());
+
+        if (it != planned.end())
+        {
+            plan.Members[it->second].MemberId = entry.second;
+        }
+        else
+        {
+            planned.insert({ memberPath.string(), plan.Members.size() });
+            plan.Members.push_back({ entry.second, memberPath });
+        }
+    }
+
+    return NarcError::None;
+}
+
+bool NarcReader::Open(const fs::path& fileName)
+{
+    Close();
+
+    if (!file.Open(fileName))
+    {
+        error = NarcError::InvalidInputFile;
+
+        return false;
+    }
+
+    if (!Load({ file.Data(), file.Size() }, fileName, true))
+    {
+        file.Close();
+
+        return false;
+    }
+
+    return true;
+}
+
+bool NarcReader::Open(ByteSpan bytes, const fs::path& name)
+{
+    Close();
+
+    return Load(bytes, name, true);
+}
+
+bool NarcReader::OpenTables(ByteSpan bytes, const fs::path& name)
+{
+    Close();
+
+    return Load(bytes, name, false);
+}
+
+// Checks what ParseArchive and BuildExtractionPlan let through, since archives in the wild get
+// away with it: a header that disagrees with the chunks or the file, slack after the FAT, reserved
+// or unterminated FNT entries, and parent or directory IDs outside the directory table
+static NarcError VerifyArchive(const ArchiveView& archive, size_t size)
+{
+    const Header& header = archive.ArchiveHeader;
+    uint64_t chunks = static_cast<uint64_t>(header.ChunkSize) + archive.Fat.ChunkSize + archive.Fnt.ChunkSize + archive.Fi.ChunkSize;
+
+    if ((header.FileSize != size) || (chunks != size)) { return NarcError::InvalidFileSize; }
+    if (archive.Fat.ChunkSize != sizeof(FileAllocationTable) + archive.FatEntries.size() * sizeof(FileAllocationTableEntry)) { return NarcError::InvalidChunkSize; }
+
+    const vector<FileNameTableEntry>& fntEntries = archive.FntEntries;
+    const uint8_t* fntData = archive.FntData.Data;
+    size_t fntSize = archive.FntData.Size;
+
+    // The root's Utility is the number of directories
+    if (fntEntries[0].Utility != fntEntries.size()) { return NarcError::InvalidFileNameTableEntryId; }
+
+    for (size_t i = 0; i < fntEntries.size(); ++i)
+    {
+        const FileNameTableEntry& entry = fntEntries[i];
+
+        if ((i > 0) && ((entry.Utility < 0xF000) || (entry.Utility - 0xF000u >= fntEntries.size()))) { return NarcError::InvalidFileNameTableEntryId; }
+
+        size_t offset = entry.Offset;
+        size_t files = 0;
+        bool terminated = false;
+
+        while (offset < fntSize)
+        {
+            uint8_t length = fntData[offset++];
+
+            if (length == 0x00)
+            {
+                terminated = true;
+                break;
+            }
+            else if (length == 0x80)
+            {
+                return NarcError::InvalidFileNameTableEntryId;
+            }
+            else if (length < 0x80)
+            {
+                if (fntSize - offset < length) { return NarcError::InvalidFileNameTableEntryId; }
+                if (!IsPlainName(fntData + offset, length)) { return NarcError::InvalidFileNameTableEntryId; }
+
+                offset += length;
+                ++files;
+            }
+            else
+            {
+                length -= 0x80;
+
+                if (fntSize - offset < static_cast<size_t>(length) + sizeof(uint16_t)) { return NarcError::InvalidFileNameTableEntryId; }
+                if (!IsPlainName(fntData + offset, length)) { return NarcError::InvalidFileNameTableEntryId; }
+
+                uint16_t directoryId;
+                memcpy(&directoryId, fntData + offset + length, sizeof(uint16_t));
+
+                if ((directoryId <= 0xF000) || (directoryId - 0xF000u >= fntEntries.size())) { return NarcError::InvalidFileNameTableEntryId; }
+
+                offset += length + sizeof(uint16_t);
+            }
+        }
+
+        if (!terminated || (entry.FirstFileId + files > archive.Fat.FileCount)) { return NarcError::InvalidFileNameTableEntryId; }
+    }
+
+    return NarcError::None;
+}
+
+bool NarcReader::Load(ByteSpan bytes, const fs::path& name, bool withImages)
+{
+    size = bytes.Size;
+    error = ParseArchive(bytes, archive, withImages);
+
+    if (error == NarcError::None)
+    {
+        error = BuildExtractionPlan(archive, name, plan);
+    }
+
+    if (error != NarcError::None)
+    {
+        return false;
+    }
+
+    // Archives without a filename table only have the names Unpack makes up for them
+    if (archive.Fnt.ChunkSize != 0x10)
+    {
+        index.reserve(plan.Members.size());
+
+        for (const auto& target : plan.Members)
+        {
+            index[target.Path.generic_string()] = static_cast<uint32_t>(target.MemberId);
+        }
+    }
+
+    return true;
+}
+
+void NarcReader::Close()
+{
+    file.Close();
+    archive = ArchiveView();
+    plan = ExtractionPlan();
+    index.clear();
+    size = 0;
+    error = NarcError::None;
+}
+
+bool NarcReader::Verify()
+{
+    error = VerifyArchive(archive, size);
+
+    if (error != NarcError::None)
+    {
+        return false;
+    }
+
+    // Unpacking skips members the FNT leaves without a path, or whose path a later member takes
+    vector<char> named(archive.FatEntries.size(), 0);
+
+    for (const auto& target : plan.Members)
+    {
+        named[target.MemberId] = 1;
+    }
+
+    if (find(named.begin(), named.end(), 0) != named.end())
+    {
+        error = NarcError::UnnamedMember;
+    }
+
+    return error == NarcError::None;
+}
+
+NarcError NarcReader::GetError() const
+{
+    return error;
+}
+
+size_t NarcReader::Count() const
+{
+    return archive.FatEntries.size();
+}
+
+bool NarcReader::Find(const string& path, size_t& id) const
+{
+    auto it = index.find(fs::path(path).generic_string());
+
+    if (it == index.end())
+    {
+        return false;
+    }
+
+    id = it->second;
+
+    return true;
+}
+
+bool NarcReader::Member(size_t id, ByteSpan& bytes) const
+{
+    // A reader opened with OpenTables has no images to point into
+    if (id >= Count() || archive.Images.Data == nullptr)
+    {
+        return false;
+    }
+
+    bytes = archive.Member(id);
+
+    return true;
+}
+
+bool NarcReader::Member(const string& path, ByteSpan& bytes) const
+{
+    size_t id;
+
+    return Find(path, id) && Member(id, bytes);
+}
+
+const ExtractionPlan& NarcReader::Plan() const
+{
+    return plan;
+}
+
+const ArchiveView& NarcReader::Archive() const
+{
+    return archive;
+}
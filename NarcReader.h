@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+#include "MappedFile.h"
+#include "Narc.h"
+
+// Random access to the members of an archive. Open maps the file and parses its tables once;
+// after that, a member is found by index or by its full FNT path with one hash probe, and its
+// bytes are returned straight out of the mapping without extracting anything else.
+class NarcReader
+{
+public:
+    NarcReader() = default;
+
+    NarcReader(const NarcReader&) = delete;
+    NarcReader& operator=(const NarcReader&) = delete;
+
+    bool Open(const fs::path& fileName);
+    // Reads an archive already in memory, which has to outlive the reader. name only stands in
+    // for the file name when making up member names for archives without a filename table.
+    bool Open(ByteSpan bytes, const fs::path& name);
+    // Reads only the tables, from the start of an archive up to the end of the GMIF chunk header,
+    // for a caller streaming the images itself. Member cannot be used.
+    bool OpenTables(ByteSpan bytes, const fs::path& name);
+    void Close();
+
+    // Stricter checks than Open, for an archive opened in full: the sizes in the header and the
+    // FAT have to agree with the file, and the FNT has to be well-formed throughout and give
+    // every member a path of its own
+    bool Verify();
+
+    NarcError GetError() const;
+
+    size_t Count() const;
+    bool Find(const std::string& path, size_t& id) const;
+
+    // Both fail for a member that does not exist, and on a reader opened with OpenTables
+    bool Member(size_t id, ByteSpan& bytes) const;
+    bool Member(const std::string& path, ByteSpan& bytes) const;
+
+    // Where each member lands when the whole archive is unpacked
+    const ExtractionPlan& Plan() const;
+    const ArchiveView& Archive() const;
+
+private:
+    MappedFile file;
+    ArchiveView archive;
+    ExtractionPlan plan;
+    std::unordered_map<std::string, uint32_t> index;
+    size_t size = 0;
+    NarcError error = NarcError::None;
+
+    bool Load(ByteSpan bytes, const fs::path& name, bool withImages);
+};
@@ -0,0 +1,181 @@
+#include "Parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+bool ParallelFor(size_t count, unsigned int workers, const function<bool(size_t)>& body)
+{
+    workers = static_cast<unsigned int>(min<size_t>(max(workers, 1u), count));
+
+    if (workers <= 1)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (!body(i))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    atomic<size_t> next(0);
+    atomic<bool> ok(true);
+
+    auto work = [&]()
+    {
+        for (size_t i = next++; i < count && ok; i = next++)
+        {
+            if (!body(i))
+            {
+                ok = false;
+            }
+        }
+    };
+
+    vector<thread> threads;
+
+    for (unsigned int i = 1; i < workers; ++i)
+    {
+        threads.emplace_back(work);
+    }
+
+    work();
+
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+
+    return ok;
+}
+
+ThreadPool::ThreadPool(unsigned int workers)
+{
+    workers = max(workers, 1u);
+
+    for (unsigned int i = 0; i < workers; ++i)
+    {
+        queues.push_back(make_unique<Queue>());
+    }
+
+    for (unsigned int i = 0; i < workers; ++i)
+    {
+        threads.emplace_back(&ThreadPool::Work, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+
+    wake.notify_all();
+
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+}
+
+void ThreadPool::Submit(function<void()> task)
+{
+    size_t target;
+
+    // Counted before it becomes visible, so a worker can never take it before it is counted
+    {
+        lock_guard<std::mutex> lock(mutex);
+        target = nextQueue++ % queues.size();
+        ++queued;
+        ++pending;
+    }
+
+    {
+        lock_guard<std::mutex> lock(queues[target]->mutex);
+        queues[target]->tasks.push_back(move(task));
+    }
+
+    wake.notify_one();
+}
+
+void ThreadPool::Wait()
+{
+    unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this]() { return pending == 0; });
+}
+
+bool ThreadPool::TryRun(size_t self)
+{
+    function<void()> task;
+
+    for (size_t i = 0; i < queues.size() && !task; ++i)
+    {
+        Queue& queue = *queues[(self + i) % queues.size()];
+        lock_guard<std::mutex> lock(queue.mutex);
+
+        if (queue.tasks.empty())
+        {
+            continue;
+        }
+
+        if (i == 0)
+        {
+            task = move(queue.tasks.back());
+            queue.tasks.pop_back();
+        }
+        else
+        {
+            task = move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+    }
+
+    if (!task)
+    {
+        return false;
+    }
+
+    {
+        lock_guard<std::mutex> lock(mutex);
+        --queued;
+    }
+
+    task();
+
+    {
+        lock_guard<std::mutex> lock(mutex);
+
+        if (--pending == 0)
+        {
+            idle.notify_all();
+        }
+    }
+
+    return true;
+}
+
+void ThreadPool::Work(size_t self)
+{
+    for (;;)
+    {
+        if (TryRun(self))
+        {
+            continue;
+        }
+
+        unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [this]() { return stopping || queued > 0; });
+
+        if (stopping && queued == 0)
+        {
+            return;
+        }
+    }
+}
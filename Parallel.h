@@ -0,0 +1,51 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Calls body(i) for every i in [0, count) across up to `workers` threads, handing out indices
+// dynamically. Stops handing out new indices once any call returns false, and returns whether
+// every call that ran succeeded. With one worker everything runs on the calling thread.
+bool ParallelFor(size_t count, unsigned int workers, const std::function<bool(size_t)>& body);
+
+// A fixed set of workers, each with its own task deque. Workers run their own tasks newest-first
+// and, once they run dry, steal the oldest task from another worker's deque.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(unsigned int workers);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    void Submit(std::function<void()> task);
+    void Wait();
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    size_t queued = 0;
+    size_t pending = 0;
+    size_t nextQueue = 0;
+    bool stopping = false;
+
+    bool TryRun(size_t self);
+    void Work(size_t self);
+};
@@ -0,0 +1,472 @@
+#include "PatternMatcher.h"
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "fnmatch.h"
+
+using namespace std;
+
+// The DFA is rebuilt from scratch if a pathological pattern set makes it grow past this
+static constexpr size_t MaxDfaStates = 4096;
+
+PatternMatcher::PatternMatcher(const fs::path& patternFile)
+{
+    if (!fs::exists(patternFile)) return;
+
+    ifstream infile(patternFile);
+    string line;
+
+    while (getline(infile, line))
+    {
+        // strip CR
+        while (!line.empty() && line.back() == '\r')
+        {
+            line.pop_back();
+        }
+
+        if (!line.empty())
+        {
+            Add(line);
+        }
+    }
+}
+
+void PatternMatcher::AffixSet::Add(const string& value)
+{
+    if (values.insert(value).second && find(lengths.begin(), lengths.end(), value.size()) == lengths.end())
+    {
+        lengths.push_back(value.size());
+    }
+}
+
+bool PatternMatcher::AffixSet::MatchesPrefixOf(const string& name) const
+{
+    for (size_t length : lengths)
+    {
+        if (length <= name.size() && values.count(name.substr(0, length)))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool PatternMatcher::AffixSet::MatchesSuffixOf(const string& name) const
+{
+    for (size_t length : lengths)
+    {
+        if (length <= name.size() && values.count(name.substr(name.size() - length)))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void PatternMatcher::Add(const string& pattern)
+{
+    // Collapse runs of '*', which match the same strings as a single one
+    string collapsed;
+    bool plain = true;
+
+    for (size_t i = 0; i < pattern.size(); ++i)
+    {
+        char c = pattern[i];
+
+        if (c == '?' || c == '[' || c == '\\')
+        {
+            plain = false;
+        }
+
+        if (c != '*' || collapsed.empty() || collapsed.back() != '*')
+        {
+            collapsed += c;
+        }
+    }
+
+    if (plain)
+    {
+        size_t star = collapsed.find('*');
+
+        if (star == string::npos)
+        {
+            literals.insert(collapsed);
+            return;
+        }
+
+        if (collapsed.find('*', star + 1) == string::npos)
+        {
+            string prefix = collapsed.substr(0, star);
+            string suffix = collapsed.substr(star + 1);
+
+            if (prefix.empty() && suffix.empty())
+            {
+                matchesAllUndotted = true;
+            }
+            else if (suffix.empty())
+            {
+                prefixes.Add(prefix);
+            }
+            else if (prefix.empty())
+            {
+                suffixes.Add(suffix);
+            }
+            else
+            {
+                vector<string>& group = bracketed[prefix];
+
+                if (group.empty() && find(bracketedPrefixLengths.begin(), bracketedPrefixLengths.end(), prefix.size()) == bracketedPrefixLengths.end())
+                {
+                    bracketedPrefixLengths.push_back(prefix.size());
+                }
+
+                group.push_back(suffix);
+            }
+
+            return;
+        }
+    }
+
+    if (!Compile(pattern))
+    {
+        fallback.push_back(pattern);
+    }
+}
+
+// Appends the pattern to the automaton's token list. Returns false for anything outside the
+// subset modelled here, which is then left to fnmatch.
+bool PatternMatcher::Compile(const string& pattern)
+{
+    vector<Token> compiled;
+
+    for (size_t i = 0; i < pattern.size(); ++i)
+    {
+        uint8_t c = static_cast<uint8_t>(pattern[i]);
+
+        if (c >= 0x80)
+        {
+            return false;
+        }
+
+        switch (c)
+        {
+            case '*':
+                if (compiled.empty() || compiled.back().kind != Token::Kind::Star)
+                {
+                    compiled.push_back({ Token::Kind::Star, 0, {} });
+                }
+                break;
+
+            case '?':
+                // fnmatch handles "*?" specially, and rejects some names the automaton would
+                // match (e.g. "*?[.]" against "c."), so those patterns are left to it
+                if (!compiled.empty() && compiled.back().kind == Token::Kind::Star) { return false; }
+                compiled.push_back({ Token::Kind::Any, 0, {} });
+                break;
+
+            case '\\':
+                // a trailing backslash never matches; leave that to fnmatch
+                if (++i == pattern.size()) { return false; }
+                compiled.push_back({ Token::Kind::Literal, static_cast<uint8_t>(pattern[i]), {} });
+                break;
+
+            case '[':
+            {
+                Token token { Token::Kind::Class, 0, {} };
+                size_t j = i + 1;
+                bool negate = false;
+
+                if (j < pattern.size() && (pattern[j] == '!' || pattern[j] == '^'))
+                {
+                    negate = true;
+                    ++j;
+                }
+
+                bool first = true;
+                bool closed = false;
+
+                for (; j < pattern.size(); first = false)
+                {
+                    uint8_t lo = static_cast<uint8_t>(pattern[j]);
+
+                    if (lo == ']' && !first)
+                    {
+                        closed = true;
+                        break;
+                    }
+
+                    if (lo >= 0x80 || (lo == '[' && j + 1 < pattern.size() && (pattern[j + 1] == ':' || pattern[j + 1] == '=' || pattern[j + 1] == '.')))
+                    {
+                        return false;
+                    }
+
+                    if (lo == '\\')
+                    {
+                        if (++j == pattern.size()) { return false; }
+                        lo = static_cast<uint8_t>(pattern[j]);
+                    }
+
+                    ++j;
+
+                    uint8_t hi = lo;
+
+                    if (j + 1 < pattern.size() && pattern[j] == '-' && pattern[j + 1] != ']')
+                    {
+                        hi = static_cast<uint8_t>(pattern[j + 1]);
+                        j += 2;
+
+                        if (hi == '\\')
+                        {
+                            if (j == pattern.size()) { return false; }
+                            hi = static_cast<uint8_t>(pattern[j++]);
+                        }
+
+                        if (hi >= 0x80 || hi == '[')
+                        {
+                            return false;
+                        }
+                    }
+
+                    for (unsigned int k = lo; k <= hi; ++k)
+                    {
+                        token.set.set(k);
+                    }
+                }
+
+                if (!closed)
+                {
+                    return false;
+                }
+
+                if (negate)
+                {
+                    token.set.flip();
+                    token.set.reset(0);
+                }
+
+                compiled.push_back(token);
+                i = j;
+                break;
+            }
+
+            default:
+                compiled.push_back({ Token::Kind::Literal, c, {} });
+                break;
+        }
+    }
+
+    compiled.push_back({ Token::Kind::Accept, 0, {} });
+
+    starts.push_back(static_cast<uint32_t>(tokens.size()));
+    tokens.insert(tokens.end(), compiled.begin(), compiled.end());
+
+    // Any DFA built so far no longer reflects the pattern set
+    dfaIds.clear();
+    dfaTransitions.clear();
+    dfaStates.clear();
+    dfaAccepting.clear();
+
+    return true;
+}
+
+void PatternMatcher::Closure(vector<uint32_t>& states) const
+{
+    // '*' may match nothing, so a state sitting on one is also sitting on whatever follows it
+    for (size_t i = 0; i < states.size(); ++i)
+    {
+        if (tokens[states[i]].kind == Token::Kind::Star)
+        {
+            states.push_back(states[i] + 1);
+        }
+    }
+
+    sort(states.begin(), states.end());
+    states.erase(unique(states.begin(), states.end()), states.end());
+}
+
+int32_t PatternMatcher::DfaState(vector<uint32_t>&& states) const
+{
+    auto it = dfaIds.find(states);
+
+    if (it != dfaIds.end())
+    {
+        return it->second;
+    }
+
+    int32_t id = static_cast<int32_t>(dfaStates.size());
+    bool accepting = false;
+
+    for (uint32_t state : states)
+    {
+        accepting |= tokens[state].kind == Token::Kind::Accept;
+    }
+
+    dfaIds.insert({ states, id });
+    dfaStates.push_back(move(states));
+    dfaAccepting.push_back(accepting);
+    dfaTransitions.emplace_back();
+    dfaTransitions.back().fill(-1);
+
+    return id;
+}
+
+int32_t PatternMatcher::DfaStep(int32_t state, uint8_t c, bool leading) const
+{
+    if (dfaTransitions[state][c] >= 0)
+    {
+        return dfaTransitions[state][c];
+    }
+
+    // FNM_PERIOD: a leading '.' can only be matched by a literal '.' at the very start of the
+    // pattern, not by a wildcard or by a '.' that a leading '*' would have to skip over
+    bool leadingPeriod = leading && c == '.';
+    bool wildcardsMatch = !leadingPeriod;
+    vector<uint32_t> states;
+
+    for (uint32_t s : dfaStates[state])
+    {
+        const Token& token = tokens[s];
+
+        if (leadingPeriod && !binary_search(starts.begin(), starts.end(), s))
+        {
+            continue;
+        }
+
+        switch (token.kind)
+        {
+            case Token::Kind::Literal:
+                if (token.c == c) { states.push_back(s + 1); }
+                break;
+
+            case Token::Kind::Any:
+                if (wildcardsMatch) { states.push_back(s + 1); }
+                break;
+
+            case Token::Kind::Class:
+                if (wildcardsMatch && token.set.test(c)) { states.push_back(s + 1); }
+                break;
+
+            case Token::Kind::Star:
+                if (wildcardsMatch) { states.push_back(s); }
+                break;
+        }
+    }
+
+    Closure(states);
+
+    int32_t id = DfaState(move(states));
+    dfaTransitions[state][c] = id;
+
+    return id;
+}
+
+bool PatternMatcher::MatchesAutomaton(const string& name) const
+{
+    if (starts.empty())
+    {
+        return false;
+    }
+
+    if (dfaStates.size() > MaxDfaStates)
+    {
+        dfaIds.clear();
+        dfaTransitions.clear();
+        dfaStates.clear();
+        dfaAccepting.clear();
+    }
+
+    if (dfaStates.empty())
+    {
+        // The start state is kept out of dfaIds: its transitions differ from those of an
+        // identical state set later on, since only the first character can be a leading period
+        vector<uint32_t> states(starts);
+        Closure(states);
+
+        dfaStates.push_back(move(states));
+        dfaAccepting.push_back(false);
+        dfaTransitions.emplace_back();
+        dfaTransitions.back().fill(-1);
+
+        for (uint32_t s : dfaStates[0])
+        {
+            if (tokens[s].kind == Token::Kind::Accept)
+            {
+                dfaAccepting[0] = true;
+            }
+        }
+    }
+
+    int32_t state = 0;
+
+    for (size_t i = 0; i < name.size(); ++i)
+    {
+        state = DfaStep(state, static_cast<uint8_t>(name[i]), i == 0);
+
+        if (dfaStates[state].empty())
+        {
+            return false;
+        }
+    }
+
+    return dfaAccepting[state];
+}
+
+bool PatternMatcher::Matches(const string& name) const
+{
+    if (literals.count(name) || prefixes.MatchesPrefixOf(name))
+    {
+        return true;
+    }
+
+    // Patterns starting with '*' never match a leading period
+    bool leadingPeriod = !name.empty() && name[0] == '.';
+
+    if (!leadingPeriod && (matchesAllUndotted || suffixes.MatchesSuffixOf(name)))
+    {
+        return true;
+    }
+
+    for (size_t length : bracketedPrefixLengths)
+    {
+        if (length > name.size())
+        {
+            continue;
+        }
+
+        auto it = bracketed.find(name.substr(0, length));
+
+        if (it == bracketed.end())
+        {
+            continue;
+        }
+
+        for (const string& suffix : it->second)
+        {
+            if (length + suffix.size() <= name.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0)
+            {
+                return true;
+            }
+        }
+    }
+
+    if (MatchesAutomaton(name))
+    {
+        return true;
+    }
+
+    for (const string& pattern : fallback)
+    {
+        if (fnmatch(pattern.c_str(), name.c_str(), FNM_PERIOD) == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
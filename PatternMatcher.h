@@ -0,0 +1,88 @@
+#pragma once
+
+#include <array>
+#include <bitset>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#if (__cplusplus < 201703L)
+#include <experimental/filesystem>
+namespace fs = std::experimental::filesystem;
+#else
+#include <filesystem>
+namespace fs = std::filesystem;
+#endif
+
+// Matches filenames against a set of fnmatch(FNM_PERIOD) patterns, as read from .knarcignore and
+// .knarckeep. Patterns are compiled once: literals, "prefix*", "*suffix" and "prefix*suffix" go
+// through hash lookups, and everything else is folded into a single lazily-built DFA so that a
+// filename is scanned once no matter how many patterns there are.
+class PatternMatcher
+{
+public:
+    PatternMatcher() = default;
+    explicit PatternMatcher(const fs::path& patternFile);
+
+    void Add(const std::string& pattern);
+    bool Matches(const std::string& name) const;
+
+private:
+    struct Token
+    {
+        enum class Kind : uint8_t
+        {
+            Literal,
+            Any,
+            Star,
+            Class,
+            Accept
+        };
+
+        Kind kind;
+        uint8_t c;
+        std::bitset<256> set;
+    };
+
+    struct AffixSet
+    {
+        std::unordered_set<std::string> values;
+        std::vector<size_t> lengths;
+
+        void Add(const std::string& value);
+        bool MatchesPrefixOf(const std::string& name) const;
+        bool MatchesSuffixOf(const std::string& name) const;
+    };
+
+    std::unordered_set<std::string> literals;
+    AffixSet prefixes;
+    AffixSet suffixes;
+    bool matchesAllUndotted = false;
+
+    // "prefix*suffix", grouped by prefix
+    std::unordered_map<std::string, std::vector<std::string>> bracketed;
+    std::vector<size_t> bracketedPrefixLengths;
+
+    // Patterns the automaton does not model, left to fnmatch: POSIX named classes ([:alpha:],
+    // [=e=], [.x.]), non-ASCII characters, trailing backslashes and "*?". Bracket expressions are
+    // built into the DFA.
+    std::vector<std::string> fallback;
+
+    std::vector<Token> tokens;
+    std::vector<uint32_t> starts;
+
+    // Lazily-built DFA over the token NFA; state 0 is the start state
+    mutable std::map<std::vector<uint32_t>, int32_t> dfaIds;
+    mutable std::vector<std::array<int32_t, 256>> dfaTransitions;
+    mutable std::vector<std::vector<uint32_t>> dfaStates;
+    mutable std::vector<bool> dfaAccepting;
+
+    bool Compile(const std::string& pattern);
+    bool MatchesAutomaton(const std::string& name) const;
+    void Closure(std::vector<uint32_t>& states) const;
+    int32_t DfaState(std::vector<uint32_t>&& states) const;
+    int32_t DfaStep(int32_t state, uint8_t c, bool leading) const;
+};
@@ -0,0 +1,189 @@
+#include "Profiler.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <string>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+using namespace std;
+
+static const char* counterNames[] =
+{
+    "statCalls",
+    "patternMatches",
+    "filesRead",
+    "bytesRead",
+    "filesWritten",
+    "bytesWritten",
+    "directoriesCreated"
+};
+
+static double Milliseconds(Profiler::Clock::duration duration)
+{
+    return chrono::duration<double, milli>(duration).count();
+}
+
+static int64_t Microseconds(Profiler::Clock::duration duration)
+{
+    return chrono::duration_cast<chrono::microseconds>(duration).count();
+}
+
+// Phase names are string literals, but the trace should not depend on that
+static string Escape(const string& text)
+{
+    string escaped;
+
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            escaped += '\\';
+        }
+
+        escaped += c;
+    }
+
+    return escaped;
+}
+
+Profiler::Profiler() : start(Clock::now())
+{
+    for (auto& counter : counters)
+    {
+        counter = 0;
+    }
+}
+
+void Profiler::Add(Counter counter, uint64_t amount)
+{
+    counters[static_cast<size_t>(counter)].fetch_add(amount, memory_order_relaxed);
+}
+
+void Profiler::Record(const char* phase, Clock::time_point start, Clock::time_point end, bool traced)
+{
+    lock_guard<std::mutex> lock(mutex);
+
+    auto it = find_if(phases.begin(), phases.end(), [&](const Phase& p) { return p.Name == phase; });
+
+    if (it == phases.end())
+    {
+        phases.push_back({ phase, 0, Clock::duration::zero() });
+        it = phases.end() - 1;
+    }
+
+    ++it->Calls;
+    it->Total += end - start;
+
+    if (traced)
+    {
+        auto thread = threads.insert({ this_thread::get_id(), threads.size() }).first;
+
+        events.push_back({ phase, start, end - start, thread->second });
+    }
+}
+
+void Profiler::WriteStats(ostream& os) const
+{
+    lock_guard<std::mutex> lock(mutex);
+
+    os << fixed << setprecision(3);
+    os << "{\n  \"wallMs\": " << Milliseconds(Clock::now() - start) << ",\n  \"phases\": {";
+
+    for (size_t i = 0; i < phases.size(); ++i)
+    {
+        os << (i == 0 ? "\n" : ",\n") << "    \"" << Escape(phases[i].Name) << "\": { \"calls\": " << phases[i].Calls
+           << ", \"ms\": " << Milliseconds(phases[i].Total) << " }";
+    }
+
+    os << (phases.empty() ? "},\n" : "\n  },\n") << "  \"counters\": {";
+
+    for (size_t i = 0; i < counters.size(); ++i)
+    {
+        os << (i == 0 ? "\n" : ",\n") << "    \"" << counterNames[i] << "\": " << counters[i].load();
+    }
+
+    os << "\n  },\n  \"process\": {";
+
+    // Whole-process figures, so in a batch they cover every job
+    bool first = true;
+    auto field = [&](const char* name, uint64_t value)
+    {
+        os << (first ? "\n" : ",\n") << "    \"" << name << "\": " << value;
+        first = false;
+    };
+
+#if defined(__unix__) || defined(__APPLE__)
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+#ifdef __APPLE__
+        field("peakRssKib", usage.ru_maxrss / 1024);
+#else
+        field("peakRssKib", usage.ru_maxrss);
+#endif
+    }
+#endif
+
+#ifdef __linux__
+    ifstream io("/proc/self/io");
+    string key;
+    uint64_t value;
+
+    while (io >> key >> value)
+    {
+        if (key == "syscr:") { field("readSyscalls", value); }
+        else if (key == "syscw:") { field("writeSyscalls", value); }
+    }
+#endif
+
+    os << (first ? "}\n}\n" : "\n  }\n}\n");
+    os << defaultfloat;
+}
+
+void Profiler::WriteTrace(ostream& os) const
+{
+    lock_guard<std::mutex> lock(mutex);
+
+    os << "{\"traceEvents\":[\n";
+
+    for (size_t i = 0; i < events.size(); ++i)
+    {
+        const Event& event = events[i];
+
+        os << (i == 0 ? "" : ",\n") << "{\"name\":\"" << Escape(event.Name) << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.Thread
+           << ",\"ts\":" << Microseconds(event.Start - start) << ",\"dur\":" << Microseconds(event.Duration) << "}";
+    }
+
+    // The counters' final values, at the end of the timeline
+    os << (events.empty() ? "" : ",\n") << "{\"name\":\"counters\",\"ph\":\"C\",\"pid\":1,\"tid\":0,\"ts\":"
+       << Microseconds(Clock::now() - start) << ",\"args\":{";
+
+    for (size_t i = 0; i < counters.size(); ++i)
+    {
+        os << (i == 0 ? "" : ",") << "\"" << counterNames[i] << "\":" << counters[i].load();
+    }
+
+    os << "}}\n]}\n";
+}
+
+ProfileScope::ProfileScope(Profiler* profiler, const char* phase, bool traced)
+    : profiler(profiler), phase(phase), traced(traced)
+{
+    if (profiler)
+    {
+        start = Profiler::Clock::now();
+    }
+}
+
+ProfileScope::~ProfileScope()
+{
+    if (profiler)
+    {
+        profiler->Record(phase, start, Profiler::Clock::now(), traced);
+    }
+}
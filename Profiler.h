@@ -0,0 +1,96 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+enum class Counter
+{
+    StatCalls,
+    PatternMatches,
+    FilesRead,
+    BytesRead,
+    FilesWritten,
+    BytesWritten,
+    DirectoriesCreated,
+    Count
+};
+
+// Phase timings and counters for --stats and --trace. Safe to share between every Narc in the
+// process; phases are kept per thread in the trace, and counters are totals.
+class Profiler
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    Profiler();
+
+    Profiler(const Profiler&) = delete;
+    Profiler& operator=(const Profiler&) = delete;
+
+    void Add(Counter counter, uint64_t amount);
+    // Traced phases also go to the trace; untraced ones, timed once per item, only add up
+    void Record(const char* phase, Clock::time_point start, Clock::time_point end, bool traced);
+
+    // JSON: the time spent in each phase, the counters, and the process's peak RSS and I/O syscalls
+    void WriteStats(std::ostream& os) const;
+    // Chrome trace-event JSON, for chrome://tracing or Perfetto
+    void WriteTrace(std::ostream& os) const;
+
+private:
+    struct Phase
+    {
+        std::string Name;
+        uint64_t Calls;
+        Clock::duration Total;
+    };
+
+    struct Event
+    {
+        const char* Name;
+        Clock::time_point Start;
+        Clock::duration Duration;
+        size_t Thread;
+    };
+
+    Clock::time_point start;
+    std::array<std::atomic<uint64_t>, static_cast<size_t>(Counter::Count)> counters;
+
+    mutable std::mutex mutex;
+    std::vector<Phase> phases;
+    std::vector<Event> events;
+    std::unordered_map<std::thread::id, size_t> threads;
+};
+
+// Times the enclosing scope as one phase; does nothing without a profiler
+class ProfileScope
+{
+public:
+    ProfileScope(Profiler* profiler, const char* phase, bool traced = true);
+    ~ProfileScope();
+
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+
+private:
+    Profiler* profiler;
+    const char* phase;
+    bool traced;
+    Profiler::Clock::time_point start;
+};
+
+inline void Count(Profiler* profiler, Counter counter, uint64_t amount = 1)
+{
+    if (profiler)
+    {
+        profiler->Add(counter, amount);
+    }
+}
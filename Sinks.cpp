@@ -0,0 +1,311 @@
+#include "Sinks.h"
+
+#include <fstream>
+#include <ios>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+using namespace std;
+
+VectorSink::VectorSink(vector<uint8_t>& bytes) : bytes(bytes)
+{
+}
+
+bool VectorSink::Write(const void* data, size_t size)
+{
+    const uint8_t* begin = static_cast<const uint8_t*>(data);
+
+    bytes.insert(bytes.end(), begin, begin + size);
+
+    return true;
+}
+
+StreamSink::StreamSink(ostream& os) : os(os)
+{
+}
+
+bool StreamSink::Write(const void* data, size_t size)
+{
+    os.write(static_cast<const char*>(data), size);
+
+    return os.good();
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+DirectorySink::DirectorySink(const fs::path& root, bool hardLinks) : root(root), hardLinks(hardLinks), openBudget(64)
+{
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+    {
+        openBudget = static_cast<size_t>(limit.rlim_cur / 2);
+    }
+
+    directories[fs::path()] = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+DirectorySink::~DirectorySink()
+{
+    for (const auto& directory : directories)
+    {
+        if (directory.second >= 0)
+        {
+            close(directory.second);
+        }
+    }
+}
+
+// Returns the fd of a directory, creating it and any missing parents first. Called with the lock held.
+int DirectorySink::OpenDirectory(const fs::path& path)
+{
+    auto it = directories.find(path);
+
+    if (it != directories.end())
+    {
+        return it->second;
+    }
+
+    // Only relative paths lie under the root, and "/" would be its own parent forever
+    if (path.has_root_path() || path.parent_path() == path)
+    {
+        return -2;
+    }
+
+    int parent = OpenDirectory(path.parent_path());
+    string name = path.filename().string();
+    int fd = -1;
+
+    if (parent >= 0)
+    {
+        if (mkdirat(parent, name.c_str(), 0777) != 0 && errno != EEXIST)
+        {
+            return -2;
+        }
+
+        if (directories.size() < openBudget)
+        {
+            fd = openat(parent, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+    }
+    else
+    {
+        error_code ec;
+        fs::create_directories(root / path, ec);
+
+        if (ec)
+        {
+            return -2;
+        }
+    }
+
+    directories[path] = fd;
+
+    return fd;
+}
+
+bool DirectorySink::Directory(const fs::path& path)
+{
+    lock_guard<mutex> lock(directoriesMutex);
+
+    return OpenDirectory(path) != -2;
+}
+
+// Finds where a member goes: its directory's fd and its filename, or the whole path from the
+// working directory once the directory is one that is not kept open
+bool DirectorySink::Locate(const fs::path& path, int& at, string& name)
+{
+    int parent;
+
+    {
+        lock_guard<mutex> lock(directoriesMutex);
+
+        parent = OpenDirectory(path.parent_path());
+    }
+
+    if (parent == -2)
+    {
+        return false;
+    }
+
+    at = parent >= 0 ? parent : AT_FDCWD;
+    name = parent >= 0 ? path.filename().string() : (root / path).string();
+
+    return true;
+}
+
+static bool WriteAndClose(int fd, ByteSpan bytes)
+{
+    for (size_t done = 0; done < bytes.Size; )
+    {
+        ssize_t written = write(fd, bytes.Data + done, bytes.Size - done);
+
+        if (written < 0 && errno != EINTR)
+        {
+            close(fd);
+
+            return false;
+        }
+
+        done += written > 0 ? written : 0;
+    }
+
+    return close(fd) == 0;
+}
+
+bool DirectorySink::Member(const fs::path& path, ByteSpan bytes)
+{
+    int at;
+    string name;
+
+    if (!Locate(path, at, name))
+    {
+        return false;
+    }
+
+    // Whatever is already there is replaced rather than written through: it may be hard linked
+    // to another member by an earlier -l unpack, whatever this one is run with
+    if (unlinkat(at, name.c_str(), 0) != 0 && errno != ENOENT)
+    {
+        return false;
+    }
+
+    int fd = openat(at, name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    return WriteAndClose(fd, bytes);
+}
+
+bool DirectorySink::Duplicate(const fs::path& path, const fs::path& original, ByteSpan bytes)
+{
+    int at;
+    int originalAt;
+    string name;
+    string originalName;
+
+    if (!Locate(path, at, name) || !Locate(original, originalAt, originalName))
+    {
+        return false;
+    }
+
+    if (unlinkat(at, name.c_str(), 0) != 0 && errno != ENOENT)
+    {
+        return false;
+    }
+
+    if (hardLinks && linkat(originalAt, originalName.c_str(), at, name.c_str(), 0) == 0)
+    {
+        return true;
+    }
+
+    int fd = openat(at, name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+
+    if (fd < 0)
+    {
+        return false;
+    }
+
+#ifdef FICLONE
+    // Shares the original's extents copy-on-write, on filesystems that can
+    int source = openat(originalAt, originalName.c_str(), O_RDONLY | O_CLOEXEC);
+    bool cloned = source >= 0 && ioctl(fd, FICLONE, source) == 0;
+
+    if (source >= 0)
+    {
+        close(source);
+    }
+
+    if (cloned)
+    {
+        return close(fd) == 0;
+    }
+#endif
+
+    return WriteAndClose(fd, bytes);
+}
+#else
+DirectorySink::DirectorySink(const fs::path& root, bool hardLinks) : root(root), hardLinks(hardLinks)
+{
+}
+
+DirectorySink::~DirectorySink()
+{
+}
+
+bool DirectorySink::Directory(const fs::path& path)
+{
+    error_code ec;
+
+    fs::create_directories(root / path, ec);
+
+    return !ec;
+}
+
+bool DirectorySink::Member(const fs::path& path, ByteSpan bytes)
+{
+    error_code ec;
+    fs::remove(root / path, ec);
+
+    ofstream ofs(root / path, ios::binary);
+
+    if (!ofs.good())
+    {
+        return false;
+    }
+
+    ofs.write(reinterpret_cast<const char*>(bytes.Data), bytes.Size);
+    ofs.close();
+
+    return ofs.good();
+}
+
+bool DirectorySink::Duplicate(const fs::path& path, const fs::path& original, ByteSpan bytes)
+{
+    if (hardLinks)
+    {
+        error_code ec;
+        fs::remove(root / path, ec);
+        fs::create_hard_link(root / original, root / path, ec);
+
+        if (!ec)
+        {
+            return true;
+        }
+    }
+
+    return Member(path, bytes);
+}
+#endif
+
+MemorySink::MemorySink(vector<MemoryMember>& members) : members(members)
+{
+}
+
+bool MemorySink::Directory(const fs::path&)
+{
+    return true;
+}
+
+bool MemorySink::Member(const fs::path& path, ByteSpan bytes)
+{
+    members.push_back({ path, vector<uint8_t>(bytes.Data, bytes.Data + bytes.Size) });
+
+    return true;
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "MappedFile.h"
+
+// A member to pack that lives in memory rather than on disk. The bytes are not copied and have
+// to outlive the Pack call.
+struct MemberView
+{
+    fs::path Path;
+    ByteSpan Data;
+};
+
+// A member unpacked into memory
+struct MemoryMember
+{
+    fs::path Path;
+    std::vector<uint8_t> Data;
+};
+
+// Where Pack writes an archive, front to back
+class ByteSink
+{
+public:
+    virtual ~ByteSink() = default;
+
+    virtual bool Write(const void* data, size_t size) = 0;
+};
+
+class VectorSink : public ByteSink
+{
+public:
+    explicit VectorSink(std::vector<uint8_t>& bytes);
+
+    bool Write(const void* data, size_t size) override;
+
+private:
+    std::vector<uint8_t>& bytes;
+};
+
+class StreamSink : public ByteSink
+{
+public:
+    explicit StreamSink(std::ostream& os);
+
+    bool Write(const void* data, size_t size) override;
+
+private:
+    std::ostream& os;
+};
+
+// Where Unpack puts the directories and members it extracts. Directories always come first, and
+// each directory is announced before any member inside it.
+class MemberSink
+{
+public:
+    virtual ~MemberSink() = default;
+
+    virtual bool Directory(const fs::path& path) = 0;
+    virtual bool Member(const fs::path& path, ByteSpan bytes) = 0;
+
+    // Writes a member whose bytes are those of a member already written to original. Sinks that
+    // can share storage between the two override this; by default the bytes are written again.
+    virtual bool Duplicate(const fs::path& path, const fs::path& original, ByteSpan bytes) { return Member(path, bytes); }
+
+    // Whether Member may be called from several threads at once
+    virtual bool Concurrent() const { return false; }
+};
+
+// Writes everything under a directory on disk. Where openat is available, each directory is
+// created once and kept open, and members are created relative to their directory's fd, so no
+// path is ever resolved from the root again. Duplicates are reflinked to the original where the
+// filesystem supports it, or hard linked to it with hardLinks, and copied otherwise. Files already
+// in the way are unlinked first, never written through, since they may be links left by -l.
+class DirectorySink : public MemberSink
+{
+public:
+    explicit DirectorySink(const fs::path& root, bool hardLinks = false);
+    ~DirectorySink();
+
+    DirectorySink(const DirectorySink&) = delete;
+    DirectorySink& operator=(const DirectorySink&) = delete;
+
+    bool Directory(const fs::path& path) override;
+    bool Member(const fs::path& path, ByteSpan bytes) override;
+    bool Duplicate(const fs::path& path, const fs::path& original, ByteSpan bytes) override;
+    bool Concurrent() const override { return true; }
+
+private:
+    fs::path root;
+    bool hardLinks;
+#if defined(__unix__) || defined(__APPLE__)
+    // Open directories by path relative to root. Only half the process's descriptor limit is
+    // spent on them; past that, a directory is stored as -1 and reached by path instead.
+    std::map<fs::path, int> directories;
+    size_t openBudget;
+    std::mutex directoriesMutex;
+
+    int OpenDirectory(const fs::path& path);
+    bool Locate(const fs::path& path, int& at, std::string& name);
+#endif
+};
+
+// Copies every member into memory, in the order they are extracted
+class MemorySink : public MemberSink
+{
+public:
+    explicit MemorySink(std::vector<MemoryMember>& members);
+
+    bool Directory(const fs::path& path) override;
+    bool Member(const fs::path& path, ByteSpan bytes) override;
+
+private:
+    std::vector<MemoryMember>& members;
+};
@@ -1,150 +1,570 @@
+#include <cstdlib>
 #include <cstring>
+#include <exception>
+#include <fstream>
 #include <iostream>
 #include <string>
+#include <vector>
 
 #include "Narc.h"
+#include "Parallel.h"
+#include "Profiler.h"
+#include "Sinks.h"
 
-using namespace std;
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
 
-bool debug = false;
-bool pack_no_fnt = true;
-bool output_header = false;
+using namespace std;
 
-void PrintError(NarcError error)
+void PrintError(NarcError error, ostream& os = cout)
 {
     switch (error)
     {
-        case NarcError::None:								cout << "ERROR: No error???" << endl;										break;
-        case NarcError::InvalidInputFile:					cout << "ERROR: Invalid input file" << endl;								break;
-        case NarcError::InvalidHeaderId:					cout << "ERROR: Invalid header ID" << endl;									break;
-        case NarcError::InvalidByteOrderMark:				cout << "ERROR: Invalid byte order mark" << endl;							break;
-        case NarcError::InvalidVersion:						cout << "ERROR: Invalid NARC version" << endl;								break;
-        case NarcError::InvalidHeaderSize:					cout << "ERROR: Invalid header size" << endl;								break;
-        case NarcError::InvalidChunkCount:					cout << "ERROR: Invalid chunk count" << endl;								break;
-        case NarcError::InvalidFileAllocationTableId:		cout << "ERROR: Invalid file allocation table ID" << endl;					break;
-        case NarcError::InvalidFileAllocationTableReserved:	cout << "ERROR: Invalid file allocation table reserved section" << endl;	break;
-        case NarcError::InvalidFileNameTableId:				cout << "ERROR: Invalid file name table ID" << endl;						break;
-        case NarcError::InvalidFileNameTableEntryId:		cout << "ERROR: Invalid file name table entry ID" << endl;					break;
-        case NarcError::InvalidFileImagesId:				cout << "ERROR: Invalid file images ID" << endl;							break;
-        case NarcError::InvalidOutputFile:					cout << "ERROR: Invalid output file" << endl;								break;
-        default:											cout << "ERROR: Unknown error???" << endl;									break;
+        case NarcError::None:								os << "ERROR: No error???" << endl;											break;
+        case NarcError::InvalidInputFile:					os << "ERROR: Invalid input file" << endl;									break;
+        case NarcError::InvalidHeaderId:					os << "ERROR: Invalid header ID" << endl;									break;
+        case NarcError::InvalidByteOrderMark:				os << "ERROR: Invalid byte order mark" << endl;								break;
+        case NarcError::InvalidVersion:						os << "ERROR: Invalid NARC version" << endl;								break;
+        case NarcError::InvalidHeaderSize:					os << "ERROR: Invalid header size" << endl;									break;
+        case NarcError::InvalidChunkCount:					os << "ERROR: Invalid chunk count" << endl;									break;
+        case NarcError::InvalidFileAllocationTableId:		os << "ERROR: Invalid file allocation table ID" << endl;					break;
+        case NarcError::InvalidFileAllocationTableReserved:	os << "ERROR: Invalid file allocation table reserved section" << endl;		break;
+        case NarcError::InvalidFileAllocationTableEntry:	os << "ERROR: Invalid file allocation table entry" << endl;					break;
+        case NarcError::InvalidFileNameTableId:				os << "ERROR: Invalid file name table ID" << endl;							break;
+        case NarcError::InvalidFileNameTableEntryId:		os << "ERROR: Invalid file name table entry ID" << endl;					break;
+        case NarcError::InvalidFileImagesId:				os << "ERROR: Invalid file images ID" << endl;								break;
+        case NarcError::InvalidChunkSize:					os << "ERROR: Invalid chunk size" << endl;									break;
+        case NarcError::InvalidOutputFile:					os << "ERROR: Invalid output file" << endl;									break;
+        case NarcError::InvalidMember:						os << "ERROR: No such member" << endl;										break;
+        case NarcError::InvalidFileSize:					os << "ERROR: File size does not match the header" << endl;					break;
+        case NarcError::ChecksumMismatch:					os << "ERROR: Members do not match the checksum list" << endl;				break;
+        case NarcError::UnnamedMember:						os << "ERROR: The file name table does not name every member" << endl;		break;
+        default:											os << "ERROR: Unknown error???" << endl;									break;
     }
 }
 
 static inline void usage() {
     cout << "OVERVIEW: Knarc" << endl << endl;
-    cout << "USAGE: knarc [options] -d DIRECTORY [-p TARGET | -u SOURCE]" << endl << endl;
+    cout << "USAGE: knarc [options] -d DIRECTORY [-p TARGET | -u SOURCE]" << endl;
+    cout << "       knarc -r TARGET -m MEMBER -f FILE" << endl;
+    cout << "       knarc [-j N] -v TARGET [-k CHECKSUMS]" << endl;
+    cout << "       knarc [-j N] [-D] [--stats] [--trace FILE] -b JOBFILE" << endl << endl;
     cout << "OPTIONS:" << endl;
     cout << "\t-d DIRECTORY\tDirectory to pack from/unpack to" << endl;
-    cout << "\t-p TARGET\tPack to the target NARC" << endl;
-    cout << "\t-u SOURCE\tUnpack from the source NARC" << endl;
+    cout << "\t-p TARGET\tPack to the target NARC, or to stdout if TARGET is -" << endl;
+    cout << "\t-u SOURCE\tUnpack from the source NARC, or from stdin if SOURCE is -" << endl;
+    cout << "\t-r TARGET\tReplace one member of the target NARC in place" << endl;
+    cout << "\t-m MEMBER\tWith -r, the member to replace, by index or by path in the filename table." << endl;
+    cout << "\t\tWith -u, unpack only matching members: an index, a range N-M or N-, or a glob; may be repeated" << endl;
+    cout << "\t-f FILE\tFile holding the member's new contents" << endl;
+    cout << "\t-v TARGET\tCheck the target NARC's structure without extracting anything" << endl;
+    cout << "\t-k CHECKSUMS\tWith -p or -u, write a checksum list of every member copied to CHECKSUMS." << endl;
+    cout << "\t\tWith -v, also check every member against it" << endl;
     cout << "\t-n\tBuild the filename table (default: discards filenames)" << endl;
     cout << "\t-D/--debug\tPrint additional debug messages" << endl;
     cout << "\t-h/--help\tPrint this message and exit" << endl;
     cout << "\t-i\tOutput a .naix header" << endl;
+    cout << "\t-j N\tUse N worker threads (default: 1)" << endl;
+    cout << "\t-c\tPack incrementally, reusing TARGET.knarccache from the last -c pack" << endl;
+    cout << "\t-s\tStore identical members once, sharing one image between them" << endl;
+    cout << "\t-l\tWith -u, hard link members that share an image instead of copying them" << endl;
+    cout << "\t-b JOBFILE\tRun every job in JOBFILE, one set of the options above per line, on -j threads" << endl;
+    cout << "\t--stats\tPrint time spent per phase, I/O counters and peak memory to stderr as JSON" << endl;
+    cout << "\t--trace FILE\tWrite a Chrome trace of every phase to FILE" << endl;
 }
 
-int main(int argc, char* argv[])
+struct Job
 {
-    string directory = "";
-    string fileName = "";
+    string directory;
+    string fileName;
+    string source;
     bool pack = false;
+    bool replace = false;
+    bool verify = false;
+    NarcOptions options;
+    bool stats = false;
+    string traceFile;
+};
+
+enum class ParseResult
+{
+    Ok,
+    Help,
+    Error
+};
+
+// Parses one set of job arguments. where prefixes error messages, and batchFile is only given
+// for the process's own command line, since job files cannot nest.
+static ParseResult ParseArguments(const vector<string>& args, Job& job, const string& where, string* batchFile)
+{
+    auto fail = [&](const string& message)
+    {
+        cerr << "ERROR: " << where << message << endl;
+
+        return ParseResult::Error;
+    };
 
-    for (int i = 1; i < argc; ++i)
+    for (size_t i = 0; i < args.size(); ++i)
     {
-        if (!strcmp(argv[i], "-d"))
+        if (args[i] == "-d")
         {
-            if (i == (argc - 1))
+            if (i == (args.size() - 1))
             {
-                cerr << "ERROR: No directory specified" << endl;
-
-                return 1;
+                return fail("No directory specified");
             }
 
-            if (!directory.empty()) {
-                cerr << "ERROR: Multiple directories specified" << endl;
-                return 1;
+            if (!job.directory.empty()) {
+                return fail("Multiple directories specified");
             }
-            directory = argv[++i];
+            job.directory = args[++i];
         }
-        else if (!strcmp(argv[i], "-p"))
+        else if (args[i] == "-p")
         {
-            if (i == (argc - 1))
+            if (i == (args.size() - 1))
             {
-                cerr << "ERROR: No NARC specified to pack to" << endl;
+                return fail("No NARC specified to pack to");
+            }
 
-                return 1;
+            if (!job.fileName.empty()) {
+                return fail("Multiple files specified");
+            }
+            job.fileName = args[++i];
+            job.pack = true;
+        }
+        else if (args[i] == "-u")
+        {
+            if (i == (args.size() - 1))
+            {
+                return fail("No NARC specified to unpack from");
             }
 
-            if (!fileName.empty()) {
-                cerr << "ERROR: Multiple files specified" << endl;
-                return 1;
+            if (!job.fileName.empty()) {
+                return fail("Multiple files specified");
             }
-            fileName = argv[++i];
-            pack = true;
+            job.fileName = args[++i];
         }
-        else if (!strcmp(argv[i], "-u"))
+        else if (args[i] == "-r")
         {
-            if (i == (argc - 1))
+            if (i == (args.size() - 1))
             {
-                cerr << "ERROR: No NARC specified to unpack from" << endl;
+                return fail("No NARC specified to replace in");
+            }
 
-                return 1;
+            if (!job.fileName.empty()) {
+                return fail("Multiple files specified");
+            }
+            job.fileName = args[++i];
+            job.replace = true;
+        }
+        else if (args[i] == "-v")
+        {
+            if (i == (args.size() - 1))
+            {
+                return fail("No NARC specified to verify");
             }
 
-            if (!fileName.empty()) {
-                cerr << "ERROR: Multiple files specified" << endl;
-                return 1;
+            if (!job.fileName.empty()) {
+                return fail("Multiple files specified");
             }
-            fileName = argv[++i];
-        } else if (!strcmp(argv[i], "-D") || !strcmp(argv[i], "--debug")) {
-            debug = true;
-        } else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
-            usage();
-            return 0;
+            job.fileName = args[++i];
+            job.verify = true;
         }
-        else if (!strcmp(argv[i], "-n")) {
-            pack_no_fnt = false;
+        else if (args[i] == "-k")
+        {
+            if (i == (args.size() - 1))
+            {
+                return fail("No checksum list specified");
+            }
+            job.options.Checksums = args[++i];
+        }
+        else if (args[i] == "-m")
+        {
+            if (i == (args.size() - 1))
+            {
+                return fail("No member specified");
+            }
+            job.options.Members.push_back(args[++i]);
+        }
+        else if (args[i] == "-f")
+        {
+            if (i == (args.size() - 1))
+            {
+                return fail("No replacement file specified");
+            }
+            job.source = args[++i];
+        } else if (args[i] == "-D" || args[i] == "--debug") {
+            job.options.Debug = true;
+        } else if (args[i] == "-h" || args[i] == "--help") {
+            return ParseResult::Help;
+        }
+        else if (args[i] == "-n") {
+            job.options.PackNoFnt = false;
+        }
+        else if (args[i] == "-i") {
+            job.options.OutputHeader = true;
+        }
+        else if (args[i] == "-c") {
+            job.options.UseCache = true;
         }
-        else if (!strcmp(argv[i], "-i")) {
-            output_header = true;
+        else if (args[i] == "-s") {
+            job.options.Deduplicate = true;
+        }
+        else if (args[i] == "-l") {
+            job.options.HardLinks = true;
+        }
+        else if (args[i] == "-j") {
+            if (i == (args.size() - 1) || atoi(args[i + 1].c_str()) <= 0)
+            {
+                return fail("-j needs a positive number of threads");
+            }
+            job.options.Jobs = atoi(args[++i].c_str());
+        }
+        else if ((args[i] == "--stats" || args[i] == "--trace") && !batchFile) {
+            return fail(args[i] + " cannot be used in a job file");
+        }
+        else if (args[i] == "--stats") {
+            job.stats = true;
+        }
+        else if (args[i] == "--trace") {
+            if (i == (args.size() - 1))
+            {
+                return fail("No trace file specified");
+            }
+            job.traceFile = args[++i];
+        }
+        else if (args[i] == "-b" && batchFile) {
+            if (i == (args.size() - 1))
+            {
+                return fail("No job file specified");
+            }
+
+            if (!batchFile->empty()) {
+                return fail("Multiple job files specified");
+            }
+            *batchFile = args[++i];
         }
         else {
             usage();
-            cerr << "ERROR: Unrecognized argument: " << argv[i] << endl;
-            return 1;
+            return fail("Unrecognized argument: " + args[i]);
         }
     }
 
-    if (fileName.empty()) {
-        cerr << "ERROR: Missing -u or -p" << endl;
-        return 1;
+    if (batchFile && !batchFile->empty())
+    {
+        const NarcOptions& options = job.options;
+
+        // Anything else belongs to a single job, and would otherwise be dropped without a word
+        if (!job.fileName.empty() || !job.directory.empty() || !job.source.empty() || !options.Members.empty() || !options.Checksums.empty()
+            || !options.PackNoFnt || options.OutputHeader || options.UseCache || options.Deduplicate || options.HardLinks)
+        {
+            return fail("-b can only be combined with -j, -D, --stats and --trace; give other options in the job file");
+        }
+
+        return ParseResult::Ok;
+    }
+
+    if (job.fileName.empty()) {
+        return fail("Missing -u, -p, -r or -v");
+    }
+    if (!job.options.Checksums.empty() && job.replace) {
+        return fail("-k cannot be combined with -r");
+    }
+    if (job.verify) {
+        if (!job.directory.empty() || !job.source.empty() || !job.options.Members.empty()) {
+            return fail("-v cannot be combined with -d, -m or -f");
+        }
+        if (job.options.Deduplicate || job.options.HardLinks) {
+            return fail("-v cannot be combined with -s or -l");
+        }
+
+        return ParseResult::Ok;
+    }
+    if (job.fileName == "-" && !batchFile) {
+        return fail(job.pack ? "-p - cannot be used in a job file" : "-u - cannot be used in a job file");
+    }
+    if (job.pack && job.fileName == "-") {
+        if (job.options.OutputHeader || job.options.UseCache) {
+            return fail("-p - cannot be combined with -i or -c");
+        }
+    }
+    if (job.options.Deduplicate && !job.pack) {
+        return fail("-s only applies to -p");
+    }
+    if (job.options.HardLinks && (job.pack || job.replace)) {
+        return fail("-l only applies to -u");
+    }
+    if (job.replace) {
+        if (job.options.Members.size() != 1 || job.source.empty()) {
+            return fail("-r needs one -m and -f");
+        }
+        if (!job.directory.empty()) {
+            return fail("-r cannot be combined with -d");
+        }
+
+        return ParseResult::Ok;
+    }
+    if (!job.source.empty()) {
+        return fail("-f only applies to -r");
+    }
+    if (job.pack && !job.options.Members.empty()) {
+        return fail("-m does not apply to -p");
+    }
+    if (job.directory.empty()) {
+        return fail("Missing -d");
+    }
+
+    return ParseResult::Ok;
+}
+
+// Splits a job file line on whitespace; double quotes group an argument containing spaces
+static vector<string> SplitJobLine(const string& line)
+{
+    vector<string> args;
+    string arg;
+    bool quoted = false;
+    bool inArg = false;
+
+    for (char c : line)
+    {
+        if (c == '"')
+        {
+            quoted = !quoted;
+            inArg = true;
+        }
+        else if (!quoted && (c == ' ' || c == '\t'))
+        {
+            if (inArg)
+            {
+                args.push_back(arg);
+                arg.clear();
+                inArg = false;
+            }
+        }
+        else
+        {
+            arg += c;
+            inArg = true;
+        }
+    }
+
+    if (inArg)
+    {
+        args.push_back(arg);
     }
-    if (directory.empty()) {
-        cerr << "ERROR: Missing -d" << endl;
+
+    return args;
+}
+
+static bool RunJob(const Job& job, NarcError& error)
+{
+    Narc narc(job.options);
+
+    bool done;
+
+    if (job.verify)
+    {
+        done = narc.Verify(job.fileName);
+    }
+    else if (job.replace)
+    {
+        done = narc.Replace(job.fileName, job.options.Members[0], job.source);
+    }
+    else if (job.pack && job.fileName == "-")
+    {
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        StreamSink sink(cout);
+
+        done = narc.Pack(job.directory, sink);
+
+        if (done && !cout.flush())
+        {
+            error = NarcError::InvalidOutputFile;
+
+            return false;
+        }
+    }
+    else if (job.fileName == "-")
+    {
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        fs::create_directory(job.directory);
+
+        DirectorySink sink(job.directory, job.options.HardLinks);
+
+        done = narc.Unpack(cin, sink);
+    }
+    else
+    {
+        done = job.pack ? narc.Pack(job.fileName, job.directory) : narc.Unpack(job.fileName, job.directory);
+    }
+
+    if (done)
+    {
+        return true;
+    }
+
+    error = narc.GetError();
+
+    return false;
+}
+
+// Runs every job in the file on a shared pool, then reports failures in file order
+static int RunBatch(const string& batchFile, const NarcOptions& defaults)
+{
+    ifstream ifs(batchFile);
+
+    if (!ifs.good())
+    {
+        cerr << "ERROR: Could not open job file " << batchFile << endl;
         return 1;
     }
 
-    Narc narc;
+    vector<Job> jobs;
+    vector<string> locations;
+    string line;
 
-    if (pack)
+    for (size_t lineNo = 1; getline(ifs, line); ++lineNo)
     {
-        if (!narc.Pack(fileName, directory))
+        while (!line.empty() && line.back() == '\r')
         {
-            PrintError(narc.GetError());
+            line.pop_back();
+        }
+
+        vector<string> args = SplitJobLine(line);
 
+        if (args.empty() || args[0][0] == '#')
+        {
+            continue;
+        }
+
+        string where = batchFile + ":" + to_string(lineNo) + ": ";
+        Job job;
+        job.options.Debug = defaults.Debug;
+        job.options.Profile = defaults.Profile;
+
+        if (ParseArguments(args, job, where, nullptr) != ParseResult::Ok)
+        {
             return 1;
         }
+
+        jobs.push_back(job);
+        locations.push_back(where);
     }
-    else
+
+    vector<NarcError> errors(jobs.size(), NarcError::None);
+    vector<string> exceptions(jobs.size());
+    vector<char> failed(jobs.size(), 0);
+
     {
-        if (!narc.Unpack(fileName, directory))
+        ThreadPool pool(defaults.Jobs);
+
+        for (size_t i = 0; i < jobs.size(); ++i)
         {
-            PrintError(narc.GetError());
+            pool.Submit([&, i]()
+                {
+                    try
+                    {
+                        failed[i] = !RunJob(jobs[i], errors[i]);
+                    }
+                    catch (const exception& e)
+                    {
+                        exceptions[i] = e.what();
+                        failed[i] = true;
+                    }
+                });
+        }
 
+        pool.Wait();
+    }
+
+    int status = 0;
+
+    for (size_t i = 0; i < jobs.size(); ++i)
+    {
+        if (!failed[i])
+        {
+            continue;
+        }
+
+        status = 1;
+
+        if (!exceptions[i].empty())
+        {
+            cout << locations[i] << "ERROR: " << exceptions[i] << endl;
+        }
+        else
+        {
+            cout << locations[i];
+            PrintError(errors[i]);
+        }
+    }
+
+    return status;
+}
+
+int main(int argc, char* argv[])
+{
+    Job job;
+    string batchFile;
+
+    switch (ParseArguments(vector<string>(argv + 1, argv + argc), job, "", &batchFile))
+    {
+        case ParseResult::Help:
+            usage();
+            return 0;
+
+        case ParseResult::Error:
             return 1;
+    }
+
+    Profiler profiler;
+
+    if (job.stats || !job.traceFile.empty())
+    {
+        job.options.Profile = &profiler;
+    }
+
+    int status = 0;
+
+    if (!batchFile.empty())
+    {
+        status = RunBatch(batchFile, job.options);
+    }
+    else
+    {
+        NarcError error;
+
+        if (!RunJob(job, error))
+        {
+            // Keep errors out of an archive being streamed to stdout
+            PrintError(error, job.pack && job.fileName == "-" ? cerr : cout);
+
+            status = 1;
+        }
+    }
+
+    // Both go somewhere other than stdout, which may be carrying an archive
+    if (job.stats)
+    {
+        profiler.WriteStats(cerr);
+    }
+
+    if (!job.traceFile.empty())
+    {
+        ofstream trace(job.traceFile);
+        profiler.WriteTrace(trace);
+
+        if (!trace.good())
+        {
+            cerr << "ERROR: Could not write trace to " << job.traceFile << endl;
+            status = 1;
         }
     }
 
-    return 0;
+    return status;
 }
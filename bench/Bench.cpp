@@ -0,0 +1,557 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if (__cplusplus < 201703L)
+#include <experimental/filesystem>
+namespace fs = std::experimental::filesystem;
+#else
+#include <filesystem>
+namespace fs = std::filesystem;
+#endif
+
+using namespace std;
+
+// Bumped whenever the generator changes, so trees left over from an older version are rebuilt
+static constexpr int GeneratorVersion = 1;
+
+// SplitMix64, so that a given case generates the same tree on every platform and standard library
+class Random
+{
+public:
+    explicit Random(uint64_t seed) : state(seed)
+    {
+    }
+
+    uint64_t Next()
+    {
+        uint64_t z = (state += 0x9E3779B97F4A7C15);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+
+        return z ^ (z >> 31);
+    }
+
+    uint64_t Below(uint64_t bound)
+    {
+        return Next() % bound;
+    }
+
+private:
+    uint64_t state;
+};
+
+enum class SizeDistribution
+{
+    Tiny,  // 16 B to 256 B, like tables and palettes
+    Mixed, // log-uniform from 16 B to 128 KiB, like a typical graphics archive
+    Large  // 64 KiB to 1 MiB
+};
+
+struct BenchCase
+{
+    uint32_t Members;
+    SizeDistribution Sizes;
+    unsigned int Depth;
+    bool OrderFile;
+    unsigned int IgnorePatterns;
+    bool Fnt;
+
+    string Name() const
+    {
+        static const char* sizeNames[] = { "tiny", "mixed", "large" };
+
+        ostringstream oss;
+        oss << "n" << Members << "-" << sizeNames[static_cast<int>(Sizes)] << "-d" << Depth;
+
+        if (OrderFile) { oss << "-order"; }
+        if (IgnorePatterns > 0) { oss << "-ignore" << IgnorePatterns; }
+        if (Fnt) { oss << "-fnt"; }
+
+        return oss.str();
+    }
+};
+
+struct Measurement
+{
+    double Seconds;
+    long PeakRssKib;
+};
+
+// Each axis is varied on its own against a small, flat, tiny-member baseline rather than taking
+// the full cross product, which would run to hundreds of gigabytes
+static vector<BenchCase> Matrix()
+{
+    vector<BenchCase> cases;
+
+    for (uint32_t members : { 10, 100, 1000, 10000, 65535 })
+    {
+        for (bool fnt : { false, true })
+        {
+            cases.push_back({ members, SizeDistribution::Tiny, 0, false, 0, fnt });
+        }
+    }
+
+    for (uint32_t members : { 100, 1000, 10000 })
+    {
+        cases.push_back({ members, SizeDistribution::Mixed, 0, false, 0, true });
+    }
+
+    for (uint32_t members : { 10, 100 })
+    {
+        cases.push_back({ members, SizeDistribution::Large, 0, false, 0, true });
+    }
+
+    // Without a filename table: packing a nested tree with -n names only some of its members, so
+    // those unpacks would not give the corpus back
+    for (unsigned int depth : { 1, 2, 4 })
+    {
+        cases.push_back({ 10000, SizeDistribution::Tiny, depth, true, 0, false });
+    }
+
+    for (uint32_t members : { 1000, 10000 })
+    {
+        cases.push_back({ members, SizeDistribution::Tiny, 0, true, 0, true });
+    }
+
+    for (unsigned int patterns : { 10, 100, 1000 })
+    {
+        cases.push_back({ 10000, SizeDistribution::Tiny, 0, false, patterns, true });
+    }
+
+    return cases;
+}
+
+static uint32_t MemberSize(SizeDistribution sizes, Random& random)
+{
+    switch (sizes)
+    {
+        case SizeDistribution::Tiny:
+            return 16 + static_cast<uint32_t>(random.Below(241));
+
+        case SizeDistribution::Mixed:
+        {
+            uint32_t base = 1u << (4 + random.Below(13));
+
+            return base + static_cast<uint32_t>(random.Below(base));
+        }
+
+        case SizeDistribution::Large:
+            return 0x10000 + static_cast<uint32_t>(random.Below(0xF0001));
+    }
+
+    return 0;
+}
+
+static bool WriteFile(const fs::path& path, const vector<char>& bytes, size_t size)
+{
+    ofstream ofs(path, ios::binary);
+    ofs.write(bytes.data(), size);
+
+    return ofs.good();
+}
+
+// Builds the tree for a case under src. Every 10th member gets an ignored .tmp sibling when the
+// case has ignore patterns, and with an order file each directory lists its members backwards.
+static bool Generate(const BenchCase& benchCase, const fs::path& src, uint64_t& totalBytes)
+{
+    Random random(0x6B6E617263 ^ (static_cast<uint64_t>(benchCase.Members) << 16) ^ static_cast<uint64_t>(benchCase.Sizes));
+    map<fs::path, vector<string>> listings;
+    vector<char> bytes;
+
+    fs::create_directories(src);
+    totalBytes = 0;
+
+    for (uint32_t i = 0; i < benchCase.Members; ++i)
+    {
+        fs::path directory;
+
+        if (benchCase.Depth > 0)
+        {
+            uint64_t levels = 1 + random.Below(benchCase.Depth);
+
+            for (uint64_t level = 0; level < levels; ++level)
+            {
+                directory /= "dir" + to_string(random.Below(4));
+            }
+        }
+
+        char name[16];
+        snprintf(name, sizeof(name), "m%05u.bin", i);
+
+        uint32_t size = MemberSize(benchCase.Sizes, random);
+
+        if (bytes.size() < size)
+        {
+            bytes.resize(size);
+        }
+
+        for (uint32_t j = 0; j < size; j += 8)
+        {
+            uint64_t word = random.Next();
+
+            for (uint32_t k = j; k < size && k < j + 8; ++k, word >>= 8)
+            {
+                bytes[k] = static_cast<char>(word);
+            }
+        }
+
+        fs::create_directories(src / directory);
+
+        if (!WriteFile(src / directory / name, bytes, size))
+        {
+            return false;
+        }
+
+        listings[directory].push_back(name);
+
+        if (benchCase.IgnorePatterns > 0 && i % 10 == 0)
+        {
+            snprintf(name, sizeof(name), "m%05u.tmp", i);
+
+            if (!WriteFile(src / directory / name, bytes, 16))
+            {
+                return false;
+            }
+        }
+
+        totalBytes += size;
+    }
+
+    if (benchCase.OrderFile)
+    {
+        for (const auto& listing : listings)
+        {
+            ofstream order(src / listing.first / ".knarcorder");
+
+            for (auto it = listing.second.rbegin(); it != listing.second.rend(); ++it)
+            {
+                order << *it << "\n";
+            }
+        }
+    }
+
+    if (benchCase.IgnorePatterns > 0)
+    {
+        // Only "*.tmp" matches anything; the rest cover each kind of pattern the matcher handles
+        ofstream ignore(src / ".knarcignore");
+        ignore << "*.tmp\n";
+
+        for (unsigned int i = 1; i < benchCase.IgnorePatterns; ++i)
+        {
+            switch (i % 3)
+            {
+                case 0: ignore << "x" << i << "_*\n"; break;
+                case 1: ignore << "*_y" << i << ".bin\n"; break;
+                case 2: ignore << "z" << i << "?[ab].dat\n"; break;
+            }
+        }
+    }
+
+    return true;
+}
+
+// What a tree holds, regardless of names and layout: the member count, their total size, and a sum
+// of per-file FNV-1a hashes. Dotfiles and the .tmp files left for ignore patterns are not members.
+struct Fingerprint
+{
+    uint64_t Files = 0;
+    uint64_t Bytes = 0;
+    uint64_t Digest = 0;
+
+    bool operator==(const Fingerprint& other) const
+    {
+        return Files == other.Files && Bytes == other.Bytes && Digest == other.Digest;
+    }
+};
+
+static Fingerprint Scan(const fs::path& root)
+{
+    Fingerprint fingerprint;
+    vector<char> buffer(0x10000);
+    error_code ec;
+
+    for (fs::recursive_directory_iterator it(root, ec), end; !ec && it != end; it.increment(ec))
+    {
+        string name = it->path().filename().string();
+
+        if (!it->is_regular_file() || name[0] == '.' || it->path().extension() == ".tmp")
+        {
+            continue;
+        }
+
+        ifstream ifs(it->path(), ios::binary);
+        uint64_t hash = 0xCBF29CE484222325;
+
+        while (ifs.read(buffer.data(), buffer.size()) || ifs.gcount() > 0)
+        {
+            for (streamsize i = 0; i < ifs.gcount(); ++i)
+            {
+                hash = (hash ^ static_cast<uint8_t>(buffer[i])) * 0x100000001B3;
+            }
+
+            fingerprint.Bytes += ifs.gcount();
+        }
+
+        ++fingerprint.Files;
+        fingerprint.Digest += hash;
+    }
+
+    return fingerprint;
+}
+
+// Runs knarc to completion and reports its wall time and peak RSS
+static bool Run(const vector<string>& args, Measurement& measurement)
+{
+    vector<char*> argv;
+
+    for (const auto& arg : args)
+    {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+
+    argv.push_back(nullptr);
+
+    // Otherwise the child would flush whatever is buffered a second time
+    fflush(stdout);
+
+    auto start = chrono::steady_clock::now();
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        // knarc reports errors on stdout, which the table is printed to
+        if (freopen("/dev/null", "w", stdout))
+        {
+            execv(argv[0], argv.data());
+        }
+        _exit(127);
+    }
+
+    int status = 0;
+    struct rusage usage;
+
+    if (pid < 0 || wait4(pid, &status, 0, &usage) != pid)
+    {
+        return false;
+    }
+
+    measurement.Seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+#ifdef __APPLE__
+    measurement.PeakRssKib = usage.ru_maxrss / 1024;
+#else
+    measurement.PeakRssKib = usage.ru_maxrss;
+#endif
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Best of several runs, and the largest peak RSS any of them reached
+static bool Measure(const vector<string>& args, unsigned int runs, const fs::path& cleanup, Measurement& best)
+{
+    best = { 0.0, 0 };
+
+    for (unsigned int run = 0; run < runs; ++run)
+    {
+        Measurement measurement;
+        error_code ec;
+
+        if (!cleanup.empty())
+        {
+            fs::remove_all(cleanup, ec);
+        }
+
+        if (!Run(args, measurement))
+        {
+            return false;
+        }
+
+        if (run == 0 || measurement.Seconds < best.Seconds)
+        {
+            best.Seconds = measurement.Seconds;
+        }
+
+        best.PeakRssKib = max(best.PeakRssKib, measurement.PeakRssKib);
+    }
+
+    return true;
+}
+
+static void usage()
+{
+    cout << "OVERVIEW: Benchmarks knarc packing and unpacking on a generated corpus" << endl << endl;
+    cout << "USAGE: knarc-bench [options]" << endl << endl;
+    cout << "OPTIONS:" << endl;
+    cout << "\t--knarc PATH\tThe knarc binary to measure (default: ./knarc)" << endl;
+    cout << "\t--dir PATH\tWhere to generate the corpus; kept between runs (default: a temporary directory)" << endl;
+    cout << "\t--runs N\tRuns per case, of which the fastest is reported (default: 3)" << endl;
+    cout << "\t--jobs N\tPass -j N to knarc (default: 1)" << endl;
+    cout << "\t--filter TEXT\tOnly run cases whose name contains TEXT" << endl;
+    cout << "\t--list\tList the cases and exit" << endl;
+    cout << "\t-h/--help\tPrint this message and exit" << endl;
+}
+
+int main(int argc, char* argv[])
+{
+    fs::path knarc = "./knarc";
+    fs::path root = fs::temp_directory_path() / "knarc-bench";
+    unsigned int runs = 3;
+    unsigned int jobs = 1;
+    string filter;
+    bool list = false;
+
+    vector<string> args(argv + 1, argv + argc);
+
+    for (size_t i = 0; i < args.size(); ++i)
+    {
+        bool hasValue = i + 1 < args.size();
+
+        if (args[i] == "--knarc" && hasValue) {
+            knarc = args[++i];
+        }
+        else if (args[i] == "--dir" && hasValue) {
+            root = args[++i];
+        }
+        else if (args[i] == "--runs" && hasValue && atoi(args[i + 1].c_str()) > 0) {
+            runs = atoi(args[++i].c_str());
+        }
+        else if (args[i] == "--jobs" && hasValue && atoi(args[i + 1].c_str()) > 0) {
+            jobs = atoi(args[++i].c_str());
+        }
+        else if (args[i] == "--filter" && hasValue) {
+            filter = args[++i];
+        }
+        else if (args[i] == "--list") {
+            list = true;
+        }
+        else if (args[i] == "-h" || args[i] == "--help") {
+            usage();
+            return 0;
+        }
+        else {
+            usage();
+            cout << "ERROR: Unrecognized argument: " << args[i] << endl;
+            return 1;
+        }
+    }
+
+    vector<BenchCase> cases;
+
+    for (const auto& benchCase : Matrix())
+    {
+        if (benchCase.Name().find(filter) != string::npos)
+        {
+            cases.push_back(benchCase);
+        }
+    }
+
+    if (list)
+    {
+        for (const auto& benchCase : cases)
+        {
+            cout << benchCase.Name() << endl;
+        }
+
+        return 0;
+    }
+
+    error_code ec;
+    knarc = fs::absolute(knarc, ec);
+
+    if (!fs::exists(knarc))
+    {
+        cout << "ERROR: No knarc binary at " << knarc << endl;
+        return 1;
+    }
+
+    printf("%-32s %10s %10s %12s %10s %10s %12s %10s\n", "case", "MiB", "pack MiB/s", "pack files/s", "pack KiB",
+        "unpk MiB/s", "unpk files/s", "unpk KiB");
+
+    int status = 0;
+
+    for (const auto& benchCase : cases)
+    {
+        fs::path directory = root / benchCase.Name();
+        fs::path src = directory / "src";
+        fs::path out = directory / "out";
+        fs::path narc = directory / "bench.narc";
+        fs::path stamp = directory / "generated";
+
+        string expected = to_string(GeneratorVersion);
+        uint64_t totalBytes = 0;
+        string generated;
+
+        ifstream previous(stamp);
+        previous >> generated >> totalBytes;
+
+        if (generated != expected)
+        {
+            fs::remove_all(directory, ec);
+
+            if (!Generate(benchCase, src, totalBytes))
+            {
+                cout << "ERROR: Could not generate " << benchCase.Name() << endl;
+                return 1;
+            }
+
+            ofstream current(stamp);
+            current << expected << " " << totalBytes << "\n";
+        }
+
+        vector<string> pack = { knarc.string(), "-j", to_string(jobs), "-d", src.string(), "-p", narc.string() };
+        vector<string> unpack = { knarc.string(), "-j", to_string(jobs), "-d", out.string(), "-u", narc.string() };
+
+        if (benchCase.Fnt)
+        {
+            pack.push_back("-n");
+        }
+
+        Measurement packed;
+        Measurement unpacked;
+
+        if (!Measure(pack, runs, narc, packed) || !Measure(unpack, runs, out, unpacked))
+        {
+            cout << "ERROR: knarc failed on " << benchCase.Name() << endl;
+            status = 1;
+            continue;
+        }
+
+        // A throughput figure only means something if every member made the round trip
+        Fingerprint source = Scan(src);
+        Fingerprint unpackedTree = Scan(out);
+
+        if (!(unpackedTree == source))
+        {
+            cout << "ERROR: Unpacking " << benchCase.Name() << " gave back " << unpackedTree.Files << " of "
+                 << source.Files << " members, or different contents" << endl;
+            status = 1;
+            fs::remove_all(out, ec);
+            continue;
+        }
+
+        double mib = totalBytes / (1024.0 * 1024.0);
+
+        printf("%-32s %10.1f %10.1f %12.0f %10ld %10.1f %12.0f %10ld\n", benchCase.Name().c_str(), mib,
+            mib / packed.Seconds, benchCase.Members / packed.Seconds, packed.PeakRssKib,
+            mib / unpacked.Seconds, benchCase.Members / unpacked.Seconds, unpacked.PeakRssKib);
+        fflush(stdout);
+
+        fs::remove_all(out, ec);
+    }
+
+    return status;
+}
@@ -0,0 +1,84 @@
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "../PatternMatcher.h"
+#include "../fnmatch.h"
+
+using namespace std;
+
+// Checks PatternMatcher against fnmatch(FNM_PERIOD), which it has to agree with exactly, on
+// random patterns and names. Usage: pattern-fuzz [SEED] [CASES]
+
+// SplitMix64, so that a given seed checks the same cases everywhere
+class Random
+{
+public:
+    explicit Random(uint64_t seed) : state(seed)
+    {
+    }
+
+    uint64_t Next()
+    {
+        uint64_t z = (state += 0x9E3779B97F4A7C15);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+
+        return z ^ (z >> 31);
+    }
+
+    uint64_t Below(uint64_t bound)
+    {
+        return Next() % bound;
+    }
+
+private:
+    uint64_t state;
+};
+
+// Pattern pieces and name characters are drawn from a small alphabet, so that random patterns
+// and names actually match each other some of the time
+static const char* pieces[] = { "a", "b", ".", "*", "?", "[ab]", "[^b]", "[!a]", "[!.]", "[a-c]", "[.]", "[]a]", "[a-]", "\\*", "\\?", "\\a", "[\\]]" };
+static const char nameChars[] = { 'a', 'b', 'c', '.', '*', '?', ']', '-' };
+
+int main(int argc, char* argv[])
+{
+    uint64_t seed = argc > 1 ? strtoull(argv[1], nullptr, 0) : 1;
+    unsigned int cases = argc > 2 ? atoi(argv[2]) : 200000;
+    Random random(seed);
+    unsigned int mismatches = 0;
+
+    for (unsigned int i = 0; i < cases; ++i)
+    {
+        string pattern;
+        string name;
+
+        for (uint64_t n = 1 + random.Below(5); n > 0; --n)
+        {
+            pattern += pieces[random.Below(sizeof(pieces) / sizeof(pieces[0]))];
+        }
+
+        for (uint64_t n = random.Below(6); n > 0; --n)
+        {
+            name += nameChars[random.Below(sizeof(nameChars))];
+        }
+
+        PatternMatcher matcher;
+        matcher.Add(pattern);
+
+        bool expected = fnmatch(pattern.c_str(), name.c_str(), FNM_PERIOD) == 0;
+
+        if (matcher.Matches(name) != expected)
+        {
+            if (++mismatches <= 20)
+            {
+                cout << "MISMATCH: '" << pattern << "' against '" << name << "': fnmatch says " << expected << endl;
+            }
+        }
+    }
+
+    cout << cases << " cases, " << mismatches << " mismatches" << endl;
+
+    return mismatches == 0 ? 0 : 1;
+}